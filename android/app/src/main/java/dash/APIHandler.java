@@ -3,25 +3,18 @@ package dash;
 import android.bluetooth.BluetoothAdapter;
 import android.content.ContentResolver;
 import android.content.Context;
-import android.content.Intent;
-import android.content.IntentFilter;
-import android.database.Cursor;
 import android.media.AudioManager;
-import android.net.Uri;
 import android.net.wifi.WifiConfiguration;
 import android.net.wifi.WifiInfo;
 import android.net.wifi.WifiManager;
-import android.os.BatteryManager;
-import android.os.Environment;
-import android.os.StatFs;
 import android.provider.Settings;
-import android.telephony.PhoneStateListener;
 import android.telephony.TelephonyManager;
 import android.util.Log;
 
 import com.getpebble.android.kit.util.PebbleDictionary;
 
 import java.lang.reflect.Method;
+import java.nio.charset.Charset;
 
 import data.CalendarManager;
 import data.Event;
@@ -42,14 +35,22 @@ class APIHandler {
         BRIGHTNESS_MODE_MANUAL = 0,
         BRIGHTNESS_MODE_AUTO = 1;
 
-    public static void handleGetData(Context context, int type, final PebbleDictionary out) {
+    // Longest string value in UTF-8 bytes, without the terminator, that the watch library makes room for from 1.8.
+    // Older libraries have a larger inbox, and are sent strings in full.
+    private static final int MAX_STRING_BYTES = 63;
+
+    private static final Charset UTF8 = Charset.forName("UTF-8");
+
+    /**
+     * Add the value of a DataType to out under valueKey, which is AppKeyDataValue for a single
+     * request, or the DataType itself for a batch request. If limitStrings is set, string values are
+     * shortened to MAX_STRING_BYTES.
+     */
+    public static void handleGetData(Context context, int type, final int valueKey, final boolean limitStrings,
+                                     final PebbleDictionary out) {
         switch(type) {
             case Keys.DataTypeBatteryPercent:
-                Intent batteryStatus = context.registerReceiver(null, new IntentFilter(Intent.ACTION_BATTERY_CHANGED));
-                int level = batteryStatus.getIntExtra(BatteryManager.EXTRA_LEVEL, -1);
-                int scale = batteryStatus.getIntExtra(BatteryManager.EXTRA_SCALE, -1);
-
-                out.addInt32(Keys.AppKeyDataValue, Math.round(((float)level / (float)scale) * 100.0F));
+                out.addInt32(valueKey, ValueCache.getBatteryPercent(context));
                 break;
 
             case Keys.DataTypeGSMOperatorName:
@@ -59,38 +60,12 @@ class APIHandler {
                     operatorName = "Unknown";
                 }
 
-                out.addString(Keys.AppKeyDataValue, operatorName);
+                addString(out, valueKey, operatorName, limitStrings);
                 break;
 
             case Keys.DataTypeGSMStrength:
-                final TelephonyManager manager = (TelephonyManager) context.getSystemService(Context.TELEPHONY_SERVICE);
-                final SignalListener listener = new SignalListener() {
-
-                    @Override
-                    public void onPercentKnown(int percent) {
-                        out.addInt32(Keys.AppKeyDataValue, percent);
-                    }
-
-                };
-
-                // Listen for update (first one happens ~immediately)
-                manager.listen(listener, PhoneStateListener.LISTEN_SIGNAL_STRENGTHS);
-
-                // After ~immediately, stop listening
-                new Thread(new Runnable() {
-
-                    @Override
-                    public void run() {
-                        try {
-                            Thread.sleep(2000);
-                            manager.listen(listener, PhoneStateListener.LISTEN_NONE);
-                        } catch(Exception e) {
-                            Log.e(TAG, "Exception waiting to stop listening to signal changes");    // Never happened yet
-                            e.printStackTrace();
-                        }
-                    }
-
-                }).start();
+                // Kept up to date by the Service's listener
+                out.addInt32(valueKey, SignalListener.getLatestPercent());
                 break;
 
             case Keys.DataTypeWifiNetworkName:
@@ -109,13 +84,11 @@ class APIHandler {
                     name = "Unknown";
                 }
 
-                out.addString(Keys.AppKeyDataValue, name);
+                addString(out, valueKey, name, limitStrings);
                 break;
 
             case Keys.DataTypeStorageFreeGBString: {
-                StatFs statFs = new StatFs(Environment.getExternalStorageDirectory().getAbsolutePath());
-                long free = statFs.getFreeBlocksLong() * (statFs.getBlockSizeLong());
-                float gigs = free / 1073741824F;
+                float gigs = ValueCache.getStorageFree() / 1073741824F;
                 float temp = gigs;
 
                 // Do some scaling for major and minor values
@@ -124,31 +97,20 @@ class APIHandler {
                 temp *= 10.0F;
                 int minor = Math.round(temp) % 10;
 
-                out.addString(Keys.AppKeyDataValue, "" + major + "." + minor + " GB");
+                addString(out, valueKey, "" + major + "." + minor + " GB", limitStrings);
             }   break;
 
             case Keys.DataTypeStoragePercentUsed: {
-                StatFs statFs = new StatFs(Environment.getExternalStorageDirectory().getAbsolutePath());
-                long free = statFs.getFreeBlocksLong() * (statFs.getBlockSizeLong());
-                long total = statFs.getBlockCountLong() * statFs.getBlockSizeLong();
+                long free = ValueCache.getStorageFree();
+                long total = ValueCache.getStorageTotal();
                 int percent = Math.round(((float) free / (float) total) * 100);
                 percent = 100 - percent;    // Get used, not free, as a percentage
 
-                out.addInt32(Keys.AppKeyDataValue, percent);
+                out.addInt32(valueKey, percent);
             }   break;
 
             case Keys.DataTypeUnreadSMSCount:
-                int unreadMessagesCount = 0;
-                try {
-                    Uri uri = Uri.parse("content://sms/inbox");
-                    Cursor c = context.getContentResolver().query(uri, null, "read = 0", null, null);
-                    unreadMessagesCount = c.getCount();
-                    c.close();
-                } catch(Exception e) {
-                    Log.e(TAG, "Exception getting unread SMS: " + e.getLocalizedMessage());
-                    e.printStackTrace();
-                }
-                out.addInt32(Keys.AppKeyDataValue, unreadMessagesCount);
+                out.addInt32(valueKey, ValueCache.getUnreadSmsCount(context));
                 break;
 
             case Keys.DataTypeNextCalendarEventOneLine: {
@@ -160,7 +122,7 @@ class APIHandler {
                         result = eventStr;
                     }
                 }
-                out.addString(Keys.AppKeyDataValue, result);
+                addString(out, valueKey, result, limitStrings);
             }   break;
 
             case Keys.DataTypeNextCalendarEventTwoLine: {
@@ -172,11 +134,60 @@ class APIHandler {
                         result = eventStr;
                     }
                 }
-                out.addString(Keys.AppKeyDataValue, result);
+                addString(out, valueKey, result, limitStrings);
             }   break;
         }
     }
 
+    /**
+     * Add a value found by handleGetData(), a Long or a String, to out under valueKey, shortening strings as
+     * handleGetData() does for limitStrings. If hash is that of the string value the watch already holds and the
+     * value is unchanged, nothing is added, and the DataType's bit for AppKeyNotModified is returned instead.
+     */
+    public static int addDataValueIfModified(int type, Object value, int valueKey, int hash, boolean limitStrings,
+                                             PebbleDictionary out) {
+        if(value instanceof String) {
+            String string = limitStrings ? limitString((String) value) : (String) value;
+            if(hash != 0 && hashValue(string) == hash) {
+                return 1 << (type - Keys.DataTypeBatteryPercent);
+            }
+            out.addString(valueKey, string);
+        } else if(value != null) {
+            out.addInt32(valueKey, ((Long) value).intValue());
+        }
+        return 0;
+    }
+
+    private static void addString(PebbleDictionary out, int key, String value, boolean limitStrings) {
+        out.addString(key, limitStrings ? limitString(value) : value);
+    }
+
+    // Shorten a string value to MAX_STRING_BYTES at a character boundary if it is longer
+    private static String limitString(String value) {
+        byte[] bytes = value.getBytes(UTF8);
+        if(bytes.length <= MAX_STRING_BYTES) {
+            return value;
+        }
+
+        int length = MAX_STRING_BYTES;
+        while(length > 0 && (bytes[length] & 0xC0) == 0x80) {
+            length--;   // Continuation byte, so the character starts earlier
+        }
+        return new String(bytes, 0, length, UTF8);
+    }
+
+    /**
+     * FNV-1a hash of the UTF-8 bytes of a string value, as value_hash() on the watch. Never 0.
+     */
+    static int hashValue(String value) {
+        int hash = 0x811C9DC5;
+        for(byte b : value.getBytes(UTF8)) {
+            hash ^= b & 0xFF;
+            hash *= 16777619;
+        }
+        return hash != 0 ? hash : 1;
+    }
+
     public static void handleSetFeature(Context context, int featureType, int featureState, PebbleDictionary out) {
         switch(featureType) {
             case Keys.FeatureTypeWifi:
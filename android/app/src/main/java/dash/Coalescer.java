@@ -0,0 +1,80 @@
+package dash;
+
+import android.content.Context;
+import android.util.SparseArray;
+
+import com.getpebble.android.kit.util.PebbleDictionary;
+
+/**
+ * Shares the values found by APIHandler between requests from any watch app made within SHARE_MS of each other,
+ * so that when several apps ask for the same DataType or FeatureType together it is looked up once. Packets are
+ * handled one at a time, so a value is shared with the requests that follow it. Worker thread only.
+ */
+class Coalescer {
+
+    private static final long SHARE_MS = 1000;
+
+    private static class Result {
+        long timeMs;
+        Object value;   // Long or String
+    }
+
+    private final Context context;
+    private final SparseArray<Result> data = new SparseArray<>();
+    private final SparseArray<Result> features = new SparseArray<>();
+
+    Coalescer(Context context) {
+        this.context = context;
+    }
+
+    /**
+     * As APIHandler.handleGetData() then addDataValueIfModified(), with a value shared from a recent request if
+     * there is one. Values are shared in full, and only shortened for the requests that limit strings.
+     */
+    int getDataIfModified(int type, int valueKey, int hash, boolean limitStrings, PebbleDictionary out) {
+        Result result = data.get(type);
+        if(!isRecent(result)) {
+            PebbleDictionary dict = new PebbleDictionary();
+            APIHandler.handleGetData(context, type, Keys.AppKeyDataValue, false, dict);
+            result = store(data, type, dict, Keys.AppKeyDataValue);
+        }
+        return APIHandler.addDataValueIfModified(type, result.value, valueKey, hash, limitStrings, out);
+    }
+
+    /**
+     * As APIHandler.handleGetFeature(), with a state shared from a recent request if there is one.
+     */
+    void getFeature(int type, PebbleDictionary out) {
+        Result result = features.get(type);
+        if(!isRecent(result)) {
+            PebbleDictionary dict = new PebbleDictionary();
+            APIHandler.handleGetFeature(context, type, dict);
+            result = store(features, type, dict, Keys.AppKeyFeatureState);
+        }
+        if(result.value != null) {
+            out.addInt32(Keys.AppKeyFeatureState, ((Long) result.value).intValue());
+        }
+    }
+
+    /**
+     * Forget all shared values, as setting a feature may change them.
+     */
+    void invalidate() {
+        data.clear();
+        features.clear();
+    }
+
+    private static boolean isRecent(Result result) {
+        return result != null && System.currentTimeMillis() - result.timeMs < SHARE_MS;
+    }
+
+    private static Result store(SparseArray<Result> results, int type, PebbleDictionary dict, int key) {
+        Result result = new Result();
+        result.timeMs = System.currentTimeMillis();
+        Long integer = dict.getInteger(key);
+        result.value = (integer != null) ? integer : dict.getString(key);
+        results.put(type, result);
+        return result;
+    }
+
+}
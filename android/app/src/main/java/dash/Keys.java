@@ -8,6 +8,8 @@ public class Keys {
             RequestTypeGetFeature = 24786,
             RequestTypeError = 24787,
             RequestTypeIsAvailable = 24788,
+            RequestTypeSubscribe = 24789,
+            RequestTypeUnsubscribe = 24790,
 
             AppKeyFeatureType = 47836,
             AppKeyFeatureState = 47837,
@@ -17,6 +19,13 @@ public class Keys {
             AppKeyAppName = 47841,
             AppKeyErrorCode = 47842,
             AppKeyLibraryVersion = 47843,
+            AppKeyMinInterval = 47844,
+            AppKeyPush = 47845,
+            AppKeySession = 47846,
+            AppKeyRequestId = 47847,
+            AppKeyPacked = 47848,
+            AppKeyValueHash = 47849,
+            AppKeyNotModified = 47850,
 
             DataTypeBatteryPercent = 678342,
             DataTypeGSMOperatorName = 678343,
@@ -47,7 +56,8 @@ public class Keys {
             ErrorCodeSendingFailed = 1,
             ErrorCodeUnavailable = 2,
             ErrorCodeNoPermissions = 3,
-            ErrorCodeWrongVersion = 4;
+            ErrorCodeWrongVersion = 4,
+            ErrorCodeRateLimited = 6;   // 5 is ErrorCodeQueueFull, only used on the watch
 
     public static String ReqKeyDataFTypeToString(int v) {
         switch (v) {
@@ -61,6 +71,10 @@ public class Keys {
                 return "RequestTypeError";
             case RequestTypeIsAvailable:
                 return "RequestTypeIsAvailable";
+            case RequestTypeSubscribe:
+                return "RequestTypeSubscribe";
+            case RequestTypeUnsubscribe:
+                return "RequestTypeUnsubscribe";
 
             case AppKeyFeatureType:
                 return "AppKeyFeatureType";
@@ -78,6 +92,20 @@ public class Keys {
                 return "AppKeyErrorCode";
             case AppKeyLibraryVersion:
                 return "AppKeyLibraryVersion";
+            case AppKeyMinInterval:
+                return "AppKeyMinInterval";
+            case AppKeyPush:
+                return "AppKeyPush";
+            case AppKeySession:
+                return "AppKeySession";
+            case AppKeyRequestId:
+                return "AppKeyRequestId";
+            case AppKeyPacked:
+                return "AppKeyPacked";
+            case AppKeyValueHash:
+                return "AppKeyValueHash";
+            case AppKeyNotModified:
+                return "AppKeyNotModified";
 
             case DataTypeBatteryPercent:
                 return "DataTypeBatteryPercent";
@@ -135,6 +163,7 @@ public class Keys {
             case ErrorCodeUnavailable: return "ErrorCodeUnavailable";
             case ErrorCodeNoPermissions: return "ErrorCodeNoPermissions";
             case ErrorCodeWrongVersion: return "ErrorCodeWrongVersion";
+            case ErrorCodeRateLimited: return "ErrorCodeRateLimited";
             default: return "Unknown";
         }
     }
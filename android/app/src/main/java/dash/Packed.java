@@ -0,0 +1,150 @@
+package dash;
+
+import com.getpebble.android.kit.util.PebbleDictionary;
+import com.getpebble.android.kit.util.PebbleTuple;
+
+import java.io.ByteArrayOutputStream;
+import java.nio.charset.Charset;
+
+/**
+ * Packed message format, shared with pebble/src/c/dash-packed.c
+ *
+ * A packed message is a single byte array under AppKeyPacked, holding the same keys and values as the
+ * dictionary it replaces:
+ *   version               - 1 byte, VERSION
+ *   entries, each:
+ *     header              - 1 byte, (key code << 2) | kind
+ *     [key]               - varint, only if the key code is CODE_ESCAPE
+ *     value               - KIND_INTEGER: zigzag varint
+ *                           KIND_STRING: varint length including the terminator, then the UTF-8 string and
+ *                           its terminator
+ *
+ * Key codes 0-15 are AppKeys, 16-31 RequestTypes and 32-47 DataTypes, relative to the first of each. Other keys
+ * use CODE_ESCAPE. Varints are unsigned LEB128.
+ */
+public class Packed {
+
+    private static final int VERSION = 1;
+    private static final int KIND_INTEGER = 0, KIND_STRING = 1;
+    private static final int CODE_ESCAPE = 63, CODE_RANGE = 16;
+    private static final int[] CODE_BASES = { Keys.AppKeyFeatureType, Keys.RequestTypeGetData, Keys.DataTypeBatteryPercent };
+    private static final Charset UTF8 = Charset.forName("UTF-8");
+
+    public static boolean isPacked(PebbleDictionary dict) {
+        return dict.getBytes(Keys.AppKeyPacked) != null;
+    }
+
+    /**
+     * Unpack the message in dict, or return null if it is not valid.
+     */
+    public static PebbleDictionary unpack(PebbleDictionary dict) {
+        byte[] data = dict.getBytes(Keys.AppKeyPacked);
+        if(data == null || data.length == 0 || data[0] != VERSION) {
+            return null;
+        }
+
+        PebbleDictionary out = new PebbleDictionary();
+        int[] offset = { 1 };
+        while(offset[0] < data.length) {
+            int header = data[offset[0]++] & 0xFF;
+            int code = header >> 2;
+            int key;
+            if(code == CODE_ESCAPE) {
+                long escaped = getVarint(data, offset);
+                if(escaped < 0) {
+                    return null;
+                }
+                key = (int)escaped;
+            } else if(code < CODE_BASES.length * CODE_RANGE) {
+                key = CODE_BASES[code / CODE_RANGE] + code % CODE_RANGE;
+            } else {
+                return null;
+            }
+
+            long value = getVarint(data, offset);
+            if(value < 0) {
+                return null;
+            }
+            switch(header & 0x3) {
+                case KIND_INTEGER:
+                    out.addInt32(key, (int)((value >>> 1) ^ -(value & 1)));
+                    break;
+                case KIND_STRING:
+                    if(value == 0 || value > data.length - offset[0] || data[offset[0] + (int)value - 1] != 0) {
+                        return null;
+                    }
+                    out.addString(key, new String(data, offset[0], (int)value - 1, UTF8));
+                    offset[0] += value;
+                    break;
+                default:
+                    return null;
+            }
+        }
+        return out;
+    }
+
+    /**
+     * Pack the integers and strings in dict into a message of its own.
+     */
+    public static PebbleDictionary pack(PebbleDictionary dict) {
+        ByteArrayOutputStream bytes = new ByteArrayOutputStream();
+        bytes.write(VERSION);
+        for(PebbleTuple tuple : dict) {
+            boolean string = tuple.type == PebbleTuple.TupleType.STRING;
+            if(!string && tuple.type != PebbleTuple.TupleType.INT && tuple.type != PebbleTuple.TupleType.UINT) {
+                continue;
+            }
+
+            int code = CODE_ESCAPE;
+            for(int i = 0; i < CODE_BASES.length; i++) {
+                if(tuple.key >= CODE_BASES[i] && tuple.key < CODE_BASES[i] + CODE_RANGE) {
+                    code = i * CODE_RANGE + tuple.key - CODE_BASES[i];
+                }
+            }
+            bytes.write((code << 2) | (string ? KIND_STRING : KIND_INTEGER));
+            if(code == CODE_ESCAPE) {
+                putVarint(bytes, tuple.key);
+            }
+
+            if(string) {
+                byte[] value = ((String)tuple.value).getBytes(UTF8);
+                putVarint(bytes, value.length + 1);
+                bytes.write(value, 0, value.length);
+                bytes.write(0);
+            } else {
+                int value = ((Number)tuple.value).intValue();
+                putVarint(bytes, (value << 1) ^ (value >> 31));
+            }
+        }
+
+        PebbleDictionary out = new PebbleDictionary();
+        out.addBytes(Keys.AppKeyPacked, bytes.toByteArray());
+        return out;
+    }
+
+    private static void putVarint(ByteArrayOutputStream bytes, int value) {
+        while((value & ~0x7F) != 0) {
+            bytes.write((value & 0x7F) | 0x80);
+            value >>>= 7;
+        }
+        bytes.write(value);
+    }
+
+    // Returns the value, or -1 if it is truncated or too long
+    private static long getVarint(byte[] data, int[] offset) {
+        long value = 0;
+        for(int shift = 0; shift < 35; shift += 7) {
+            if(offset[0] >= data.length) {
+                return -1;
+            }
+
+            int b = data[offset[0]++] & 0xFF;
+            value |= (long)(b & 0x7F) << shift;
+            if((b & 0x80) == 0) {
+                return value & 0xFFFFFFFFL;
+            }
+        }
+        return -1;
+    }
+
+}
@@ -0,0 +1,72 @@
+package dash;
+
+import java.util.HashMap;
+import java.util.Iterator;
+import java.util.UUID;
+
+/**
+ * A token bucket for each watch app, so that one sending requests without limit cannot hold up the others.
+ * An app may send up to burst requests at once, and then perSecond on average. Worker thread only.
+ */
+class RateLimiter {
+
+    // Buckets full and unused for this long are dropped, as a new one would start full anyway
+    private static final long IDLE_MS = 60 * 1000;
+
+    private static class Bucket {
+        double tokens;
+        long updatedMs;
+    }
+
+    private final HashMap<UUID, Bucket> buckets = new HashMap<>();
+    private final int burst;
+    private final double perSecond;
+    private long evictedMs;
+
+    RateLimiter(int burst, double perSecond) {
+        this.burst = burst;
+        this.perSecond = perSecond;
+    }
+
+    /**
+     * Take a token for a request from uuid. Returns false if it is over its budget, and should be refused.
+     */
+    boolean tryAcquire(UUID uuid) {
+        long now = System.currentTimeMillis();
+        if(now - evictedMs >= IDLE_MS) {
+            evictIdle(now);
+        }
+
+        Bucket bucket = buckets.get(uuid);
+        if(bucket == null) {
+            bucket = new Bucket();
+            bucket.tokens = burst;
+            buckets.put(uuid, bucket);
+        } else {
+            bucket.tokens = refill(bucket, now);
+        }
+        bucket.updatedMs = now;
+
+        if(bucket.tokens < 1) {
+            return false;
+        }
+        bucket.tokens--;
+        return true;
+    }
+
+    private double refill(Bucket bucket, long now) {
+        return Math.min(burst, bucket.tokens + (now - bucket.updatedMs) * perSecond / 1000.0);
+    }
+
+    private void evictIdle(long now) {
+        evictedMs = now;
+        Iterator<Bucket> it = buckets.values().iterator();
+        while(it.hasNext()) {
+            Bucket bucket = it.next();
+            if(now - bucket.updatedMs >= IDLE_MS && refill(bucket, now) >= burst) {
+                it.remove();
+            }
+        }
+    }
+
+}
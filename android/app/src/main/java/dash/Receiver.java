@@ -14,25 +14,59 @@ import java.util.UUID;
 import static com.getpebble.android.kit.Constants.TRANSACTION_ID;
 
 /**
+ * Header (inbound):
+ *   UsesDashAPIKey
+ *   AppNameKey and LibraryVersionKey for a handshake, or SessionKey once a session is started
+ *   RequestIdKey          - ID of the request, unique among those in progress
+ *
+ * Header (outbound):
+ *   RequestIdKey          - ID of the request being answered, as received
+ *   SessionKey            - New session after a handshake, or 0 if the session is unknown
+ *
  * Formats (inbound):
  *   RequestTypeGetData
  *     DataTypeKey         - DataType
+ *     [ValueHashKey]      - Hash of the string value the watch holds, if any
+ *   RequestTypeGetData (batch)
+ *     <DataType>          - Hash of the string value the watch holds, or 0, for each DataType requested
  *   RequestTypeSetFeature
  *     FeatureTypeKey      - FeatureType
  *     FeatureStateKey     - FeatureState
+ *   RequestTypeSetFeature (several)
+ *     <FeatureType>       - FeatureState, for each FeatureType, set in order of FeatureType
  *   RequestTypeGetFeature
  *     FeatureTypeKey      - FeatureType
+ *   RequestTypeSubscribe
+ *     DataTypeKey         - DataType
+ *     MinIntervalKey      - Minimum milliseconds between pushes
+ *   RequestTypeUnsubscribe
+ *     DataTypeKey         - DataType
  *
  * Formats (outbound):
  *   RequestTypeGetData
  *     DataTypeKey         - DataType
  *     DataValueKey        - DataValue
+ *   RequestTypeGetData (batch)
+ *     <DataType>          - DataValue, for each DataType requested
+ *   RequestTypeGetData (either)
+ *     [NotModifiedKey]    - Bit of each DataType sent without a value, as it matched the hash
  *   RequestTypeSetFeature
  *     FeatureTypeKey      - FeatureType
  *     FeatureStateKey     - FeatureState
+ *   RequestTypeSetFeature (several)
+ *     <FeatureType>       - FeatureState, for each FeatureType set
  *   RequestTypeGetFeature
  *     FeatureTypeKey      - FeatureType
  *     FeatureStateKey     - FeatureState
+ *   RequestTypeGetData (response to RequestTypeSubscribe, or pushed with PushKey)
+ *     DataTypeKey         - DataType
+ *     DataValueKey        - DataValue
+ *     PushKey             - 0
+ *   RequestTypeUnsubscribe
+ *     DataTypeKey         - DataType
+ *
+ * A watch app may instead send the whole packet as a byte array under PackedKey, in the format described in
+ * Packed. Responses to such packets are packed the same way, while pushes are always sent as dictionaries.
  */
 public class Receiver extends BroadcastReceiver {
 
@@ -46,7 +80,7 @@ public class Receiver extends BroadcastReceiver {
             PebbleDictionary dict = PebbleDictionary.fromJson(json);
 
             // Is this a job for Captain Dash API?
-            if(dict.getInteger(Keys.AppKeyUsesDashAPI) == null) {
+            if(dict.getInteger(Keys.AppKeyUsesDashAPI) == null && !Packed.isPacked(dict)) {
                 return;
             }
 
@@ -57,7 +91,10 @@ public class Receiver extends BroadcastReceiver {
             int transactionId = intent.getIntExtra(TRANSACTION_ID, -1);
             PebbleKit.sendAckToPebble(context, transactionId);
 
-            // Call Service
+            // Pass the parsed packet to the Service, or start it with the packet if it is not running
+            if(Service.dispatch(dict, uuid)) {
+                return;
+            }
             Intent i = new Intent(context, Service.class);
             i.putExtra("json", json);
             i.putExtra("uuid", uuid.toString());
@@ -2,26 +2,36 @@ package dash;
 
 import android.app.NotificationManager;
 import android.app.PendingIntent;
+import android.content.BroadcastReceiver;
 import android.content.Context;
 import android.content.Intent;
 import android.content.SharedPreferences;
 import android.graphics.Color;
 import android.os.Bundle;
+import android.os.Handler;
+import android.os.HandlerThread;
 import android.os.IBinder;
+import android.os.Looper;
 import android.preference.PreferenceManager;
 import android.support.v4.app.NotificationCompat;
+import android.telephony.PhoneStateListener;
+import android.telephony.TelephonyManager;
 import android.util.Log;
 
 import com.getpebble.android.kit.PebbleKit;
 import com.getpebble.android.kit.util.PebbleDictionary;
+import com.wordpress.ninedof.dashapi.BuildConfig;
 import com.wordpress.ninedof.dashapi.R;
 
 import org.json.JSONArray;
 import org.json.JSONObject;
 
+import java.util.HashMap;
+import java.util.Random;
 import java.util.UUID;
 
 import activity.Landing;
+import data.CalendarManager;
 import data.Meta;
 import data.PermissionManager;
 
@@ -29,31 +39,149 @@ import data.PermissionManager;
 public class Service extends android.app.Service {
 
     private static final String TAG = Service.class.getName();
-    private static final boolean DEBUG = true;
+    private static final boolean DEBUG = BuildConfig.DEBUG;
+
+    private static final int MAX_SESSION = 0x7FFF;
+
+    // Request budget of each watch app, from the settings. The defaults allow a burst of widgets refreshing together.
+    private static final String
+        KEY_RATE_LIMIT_BURST = "RATE_LIMIT_BURST",
+        KEY_RATE_LIMIT_PER_SECOND = "RATE_LIMIT_PER_SECOND";
+    private static final int RATE_LIMIT_BURST = 20;
+    private static final double RATE_LIMIT_PER_SECOND = 5;
+
+    private static Service instance;   // While running, so the Receiver can dispatch packets without an Intent
+
+    private final HashMap<UUID, Integer> sessions = new HashMap<>();   // Worker thread only
+    private RateLimiter rateLimiter;   // Worker thread only
+    private Coalescer coalescer;   // Worker thread only
+    private final Random random = new Random();
+    private final Handler mainHandler = new Handler(Looper.getMainLooper());
+    private HandlerThread worker;
+    private Handler workerHandler;
+    private SubscriptionManager subscriptionManager;   // Main thread only
+    private SignalListener signalListener;
+    private BroadcastReceiver disconnectedReceiver;
+
+    /**
+     * Handle a packet already parsed by the Receiver on the running service's worker thread.
+     * Returns false if the service is not running, in which case it must be started with the packet.
+     */
+    static synchronized boolean dispatch(PebbleDictionary dict, UUID uuid) {
+        if(instance == null) {
+            return false;
+        }
+
+        instance.post(dict, uuid);
+        return true;
+    }
+
+    private void post(final PebbleDictionary dict, final UUID uuid) {
+        workerHandler.post(new Runnable() {
+
+            @Override
+            public void run() {
+                try {
+                    if(DEBUG) {
+                        String jsonData = dict.toJsonString();
+                        Log.d(TAG, "JSON in: " + jsonData);
+                        analyse(jsonData);
+                    }
+
+                    if(Packed.isPacked(dict)) {
+                        PebbleDictionary unpacked = Packed.unpack(dict);
+                        if(unpacked == null) {
+                            Log.e(TAG, "Invalid packed packet from " + uuid.toString());
+                            return;
+                        }
+                        parse(unpacked, uuid, true);
+                    } else {
+                        parse(dict, uuid, false);
+                    }
+                } catch (Exception e) {
+                    Log.e(TAG, "parse() threw exception: " + e.getLocalizedMessage());
+                    e.printStackTrace();
+                }
+            }
+
+        });
+    }
 
-    private void parse(PebbleDictionary dict, final UUID uuid) {
+    private void parse(PebbleDictionary dict, final UUID uuid, boolean packed) {
         Context context = getApplicationContext();
         final PebbleDictionary out = new PebbleDictionary();
 
-        // Check version first
-        String versionRemote = dict.getString(Keys.AppKeyLibraryVersion);
-        if(Meta.isRemoteCompatible(versionRemote)) {
-            out.addInt32(Keys.RequestTypeError, 0);
-            out.addInt32(Keys.AppKeyErrorCode, Keys.ErrorCodeSuccess);
-        } else {
+        // Echo the request ID, so the watch can match responses that arrive out of order
+        Long requestId = dict.getInteger(Keys.AppKeyRequestId);
+        if(requestId != null) {
+            out.addInt32(Keys.AppKeyRequestId, requestId.intValue());
+        }
+
+        // Refuse apps over their budget before doing any work for them
+        if(!rateLimiter.tryAcquire(uuid)) {
+            Log.w(TAG, "Rate limiting " + uuid.toString());
             out.addInt32(Keys.RequestTypeError, 0);
-            out.addInt32(Keys.AppKeyErrorCode, Keys.ErrorCodeWrongVersion);
-            PebbleKit.sendDataToPebble(getApplicationContext(), uuid, out);
+            out.addInt32(Keys.AppKeyErrorCode, Keys.ErrorCodeRateLimited);
+            respond(uuid, out, packed);
             return;
         }
 
+        // Check version first, once per session
+        String versionRemote = dict.getString(Keys.AppKeyLibraryVersion);
+
+        // Libraries from 1.8 only make room for strings of APIHandler.MAX_STRING_BYTES, and send their version at
+        // the handshake alone. Older ones send it with every request.
+        boolean limitStrings = versionRemote == null || Meta.isRemoteAtLeast(versionRemote, 1, 8);
+        if(versionRemote != null) {
+            if(!Meta.isRemoteCompatible(versionRemote)) {
+                sessions.remove(uuid);
+                out.addInt32(Keys.RequestTypeError, 0);
+                out.addInt32(Keys.AppKeyErrorCode, Keys.ErrorCodeWrongVersion);
+                respond(uuid, out, packed);
+                return;
+            }
+
+            // Handshake
+            checkPermissionEntry(dict, uuid);
+            out.addInt32(Keys.AppKeySession, startSession(uuid));
+        } else {
+            Long session = dict.getInteger(Keys.AppKeySession);
+            Integer known = sessions.get(uuid);
+            if(session == null || known == null || known.intValue() != session.intValue()) {
+                // Unknown session, such as after this service was restarted, so the watch must handshake again
+                out.addInt32(Keys.AppKeySession, 0);
+                respond(uuid, out, packed);
+                return;
+            }
+        }
+        out.addInt32(Keys.RequestTypeError, 0);
+        out.addInt32(Keys.AppKeyErrorCode, Keys.ErrorCodeSuccess);
+
         // Get data request
         if(dict.getInteger(Keys.RequestTypeGetData) != null) {
             out.addInt32(Keys.RequestTypeGetData, 0);
 
-            int type = dict.getInteger(Keys.AppKeyDataType).intValue();
-            out.addInt32(Keys.AppKeyDataType, type);
-            APIHandler.handleGetData(context, type, out);
+            // Values matching the hash of what the watch holds are only marked as not modified
+            int notModified = 0;
+            Long type = dict.getInteger(Keys.AppKeyDataType);
+            if(type != null) {
+                out.addInt32(Keys.AppKeyDataType, type.intValue());
+                Long hash = dict.getInteger(Keys.AppKeyValueHash);
+                notModified |= coalescer.getDataIfModified(type.intValue(), Keys.AppKeyDataValue,
+                        hash != null ? hash.intValue() : 0, limitStrings, out);
+            } else {
+                // Batch request, with each value keyed by its DataType
+                for(int batchType = Keys.DataTypeBatteryPercent; batchType <= Keys.DataTypeNextCalendarEventTwoLine; batchType++) {
+                    Long hash = dict.getInteger(batchType);
+                    if(hash != null) {
+                        notModified |= coalescer.getDataIfModified(batchType, batchType, hash.intValue(),
+                                limitStrings, out);
+                    }
+                }
+            }
+            if(notModified != 0) {
+                out.addInt32(Keys.AppKeyNotModified, notModified);
+            }
         }
 
         // Set feature request
@@ -66,13 +194,25 @@ public class Service extends android.app.Service {
                 notifyNoPermission(uuid);
             } else {
                 out.addInt32(Keys.RequestTypeSetFeature, 0);
+                coalescer.invalidate();
 
-                int type = dict.getInteger(Keys.AppKeyFeatureType).intValue();
-                out.addInt32(Keys.AppKeyFeatureType, type);
-                int state = dict.getInteger(Keys.AppKeyFeatureState).intValue();
-                out.addInt32(Keys.AppKeyFeatureState, state);
+                Long type = dict.getInteger(Keys.AppKeyFeatureType);
+                if(type != null) {
+                    out.addInt32(Keys.AppKeyFeatureType, type.intValue());
+                    int state = dict.getInteger(Keys.AppKeyFeatureState).intValue();
+                    out.addInt32(Keys.AppKeyFeatureState, state);
 
-                APIHandler.handleSetFeature(context, type, state, out);
+                    APIHandler.handleSetFeature(context, type.intValue(), state, out);
+                } else {
+                    // Several features, with each state keyed by its FeatureType and set in that order
+                    for(int batchType = Keys.FeatureTypeWifi; batchType <= Keys.FeatureTypeAutoBrightness; batchType++) {
+                        Long state = dict.getInteger(batchType);
+                        if(state != null) {
+                            out.addInt32(batchType, state.intValue());
+                            APIHandler.handleSetFeature(context, batchType, state.intValue(), out);
+                        }
+                    }
+                }
             }
         }
 
@@ -82,7 +222,46 @@ public class Service extends android.app.Service {
 
             int type = dict.getInteger(Keys.AppKeyFeatureType).intValue();
             out.addInt32(Keys.AppKeyFeatureType, type);
-            APIHandler.handleGetFeature(context, type, out);
+            coalescer.getFeature(type, out);
+        }
+
+        // Subscribe request, answered with the current value
+        if(dict.getInteger(Keys.RequestTypeSubscribe) != null) {
+            out.addInt32(Keys.RequestTypeGetData, 0);
+
+            final int type = dict.getInteger(Keys.AppKeyDataType).intValue();
+            out.addInt32(Keys.AppKeyDataType, type);
+            APIHandler.handleGetData(context, type, Keys.AppKeyDataValue, limitStrings, out);
+
+            final long minIntervalMs = dict.getInteger(Keys.AppKeyMinInterval).longValue();
+            mainHandler.post(new Runnable() {
+
+                @Override
+                public void run() {
+                    if(subscriptionManager != null) {
+                        subscriptionManager.subscribe(uuid, type, minIntervalMs, out);
+                    }
+                }
+
+            });
+        }
+
+        // Unsubscribe request
+        if(dict.getInteger(Keys.RequestTypeUnsubscribe) != null) {
+            out.addInt32(Keys.RequestTypeUnsubscribe, 0);
+
+            final int type = dict.getInteger(Keys.AppKeyDataType).intValue();
+            out.addInt32(Keys.AppKeyDataType, type);
+            mainHandler.post(new Runnable() {
+
+                @Override
+                public void run() {
+                    if(subscriptionManager != null) {
+                        subscriptionManager.unsubscribe(uuid, type);
+                    }
+                }
+
+            });
         }
 
         // Is available request
@@ -90,21 +269,31 @@ public class Service extends android.app.Service {
             // Handled by AppKeyLibraryVersion in header
         }
 
-        // Wait at least xms for GSM signal strength listener to resolve
-        // Does not appear to happen immediately
-        new Thread(new Runnable() {
+        // All values are known by now, so respond from this thread
+        respond(uuid, out, packed);
+        Log.d(TAG, "Sent response to " + uuid.toString());
+        if(DEBUG) {
+            Log.d(TAG, "JSON out: " + out.toJsonString());
+        }
+    }
 
-            @Override
-            public void run() {
-                PebbleKit.sendDataToPebble(getApplicationContext(), uuid, out);
-                Log.d(TAG, "Sent response to " + uuid.toString());
-                if(DEBUG) {
-                    Log.d(TAG, "JSON out: " + out.toJsonString());
-                }
-            }
+    // Reply in the format of the request
+    private void respond(UUID uuid, PebbleDictionary out, boolean packed) {
+        PebbleKit.sendDataToPebble(getApplicationContext(), uuid, packed ? Packed.pack(out) : out);
+    }
 
-        }).start();
+    // Issue a token for the watch to send instead of its name and version, which have been validated. Requests sent
+    // together at startup each handshake, so a live session is returned again rather than replaced under those
+    // still in flight.
+    private int startSession(UUID uuid) {
+        Integer known = sessions.get(uuid);
+        if(known != null) {
+            return known;
+        }
 
+        int session = 1 + random.nextInt(MAX_SESSION);
+        sessions.put(uuid, session);
+        return session;
     }
 
     private void checkPermissionEntry(PebbleDictionary dict, UUID uuid) {
@@ -118,7 +307,6 @@ public class Service extends android.app.Service {
 
         }
 
-        SharedPreferences prefs = PreferenceManager.getDefaultSharedPreferences(context);
         PermissionManager.setName(context, uuid, name);
     }
 
@@ -142,6 +330,90 @@ public class Service extends android.app.Service {
         mNotifyMgr.notify(id, builder.build());
     }
 
+    @Override
+    public void onCreate() {
+        super.onCreate();
+
+        // Packets are handled in order on one long-lived thread, off the main thread
+        worker = new HandlerThread(TAG);
+        worker.start();
+        workerHandler = new Handler(worker.getLooper());
+        coalescer = new Coalescer(getApplicationContext());
+        workerHandler.post(new Runnable() {
+
+            @Override
+            public void run() {
+                rateLimiter = createRateLimiter();
+            }
+
+        });
+
+        // SubscriptionManager is used on the main thread, and looks values up on the worker
+        subscriptionManager = new SubscriptionManager(getApplicationContext(), workerHandler);
+
+        // Keep the signal strength up to date for as long as the service runs
+        signalListener = new SignalListener();
+        TelephonyManager manager = (TelephonyManager) getSystemService(Context.TELEPHONY_SERVICE);
+        manager.listen(signalListener, PhoneStateListener.LISTEN_SIGNAL_STRENGTHS);
+
+        // Watch apps handshake again on reconnection
+        disconnectedReceiver = PebbleKit.registerPebbleDisconnectedReceiver(getApplicationContext(), new BroadcastReceiver() {
+
+            @Override
+            public void onReceive(Context context, Intent intent) {
+                workerHandler.post(new Runnable() {
+
+                    @Override
+                    public void run() {
+                        sessions.clear();
+                    }
+
+                });
+            }
+
+        });
+
+        synchronized(Service.class) {
+            instance = this;
+        }
+    }
+
+    // The settings are read when the service starts, off the main thread as they may not be loaded yet
+    private RateLimiter createRateLimiter() {
+        SharedPreferences prefs = PreferenceManager.getDefaultSharedPreferences(getApplicationContext());
+        int burst = (int) readPositive(prefs, KEY_RATE_LIMIT_BURST, RATE_LIMIT_BURST);
+        double perSecond = readPositive(prefs, KEY_RATE_LIMIT_PER_SECOND, RATE_LIMIT_PER_SECOND);
+        return new RateLimiter(Math.max(1, burst), perSecond);
+    }
+
+    // Settings are edited as text, so anything that is not a positive number leaves the default
+    private static double readPositive(SharedPreferences prefs, String key, double defaultValue) {
+        try {
+            double value = Double.parseDouble(prefs.getString(key, ""));
+            return (value > 0) ? value : defaultValue;
+        } catch(NumberFormatException e) {
+            return defaultValue;
+        }
+    }
+
+    @Override
+    public void onDestroy() {
+        synchronized(Service.class) {
+            instance = null;
+        }
+        worker.quitSafely();
+
+        subscriptionManager.release();
+        subscriptionManager = null;   // For packets still being handled by the worker
+        TelephonyManager manager = (TelephonyManager) getSystemService(Context.TELEPHONY_SERVICE);
+        manager.listen(signalListener, PhoneStateListener.LISTEN_NONE);
+        getApplicationContext().unregisterReceiver(disconnectedReceiver);
+        ValueCache.release();
+        CalendarManager.release();
+
+        super.onDestroy();
+    }
+
     @Override
     public int onStartCommand(Intent intent, int flags, int startId) {
         if (intent == null) {
@@ -152,19 +424,13 @@ public class Service extends android.app.Service {
         try {
             Log.d(TAG, "onStartCommand()");
 
-            //Get dictionary and parse
+            // Started with the first packet, which could not be dispatched before the service was running
             Bundle extras = intent.getExtras();
             String jsonData = extras.getString("json");
-            if(DEBUG) {
-                Log.d(TAG, "JSON in: " + jsonData);
-                analyse(jsonData);
-            }
-
             String uuidString = extras.getString("uuid");
             UUID uuid = UUID.fromString(uuidString);
             PebbleDictionary dict = PebbleDictionary.fromJson(jsonData);
-            checkPermissionEntry(dict, uuid);
-            parse(dict, uuid);
+            post(dict, uuid);
         } catch (Exception e) {
             Log.e(TAG, "onStartCommand() threw exception: " + e.getLocalizedMessage());
             e.printStackTrace();
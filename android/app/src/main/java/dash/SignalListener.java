@@ -4,7 +4,11 @@ import android.telephony.PhoneStateListener;
 import android.telephony.SignalStrength;
 import android.util.Log;
 
-public abstract class SignalListener extends PhoneStateListener {
+/**
+ * Listens for GSM signal strength changes. The latest percentage from any listener is kept, so that
+ * DataTypeGSMStrength can be answered immediately while the Service's listener is registered.
+ */
+public class SignalListener extends PhoneStateListener {
 
     private static final String TAG = SignalListener.class.getName();
 
@@ -12,6 +16,8 @@ public abstract class SignalListener extends PhoneStateListener {
         UNKNOWN_CODE = 99,
         MAX_SIGNAL_DBM_VALUE = 31;
 
+    private static volatile int latestPercent;
+
     private int calculateSignalStrengthInPercent(int signalStrength) {
         return Math.round(((float)signalStrength / (float)MAX_SIGNAL_DBM_VALUE) * 100);
     }
@@ -27,9 +33,20 @@ public abstract class SignalListener extends PhoneStateListener {
             Log.e(TAG, "Unable to get phone signal strength!");
         }
 
+        latestPercent = percent;
         onPercentKnown(percent);
     }
 
-    public abstract void onPercentKnown(int percent);
+    /**
+     * Called with each new percentage. Override to be notified of changes.
+     */
+    public void onPercentKnown(int percent) { }
+
+    /**
+     * The latest signal strength as a percentage, or 0 before the first is known.
+     */
+    public static int getLatestPercent() {
+        return latestPercent;
+    }
 
 }
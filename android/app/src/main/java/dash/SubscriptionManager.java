@@ -0,0 +1,415 @@
+package dash;
+
+import android.content.BroadcastReceiver;
+import android.content.Context;
+import android.content.Intent;
+import android.content.IntentFilter;
+import android.database.ContentObserver;
+import android.net.Uri;
+import android.net.wifi.WifiManager;
+import android.os.Handler;
+import android.os.Looper;
+import android.provider.CalendarContract;
+import android.telephony.PhoneStateListener;
+import android.telephony.ServiceState;
+import android.telephony.TelephonyManager;
+import android.util.Log;
+import android.util.SparseArray;
+
+import com.getpebble.android.kit.PebbleKit;
+import com.getpebble.android.kit.util.PebbleDictionary;
+
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.HashSet;
+import java.util.UUID;
+
+import data.CalendarManager;
+
+/**
+ * Pushes DataType values to watch apps that have subscribed to them, only when they change and no
+ * more often than each subscription's minimum interval.
+ *
+ * Sources (registered only while a DataType they serve is subscribed to):
+ *   Battery  - ACTION_BATTERY_CHANGED
+ *   Wifi     - NETWORK_STATE_CHANGED_ACTION
+ *   SMS      - ContentObserver on content://sms
+ *   Phone    - SignalListener for signal strength and service state (operator name)
+ *   Calendar - ContentObserver on the calendar provider
+ *   Tick     - ACTION_TIME_TICK for storage and the next calendar event, which change with time
+ *
+ * Used on the main thread. Changed values are looked up on the Service's worker thread, as calendar and SMS
+ * queries block.
+ */
+class SubscriptionManager {
+
+    private static final String TAG = SubscriptionManager.class.getName();
+
+    private static final int MAX_NACKED_PUSHES = 3;  // Consecutive, before the watch app is assumed closed
+
+    private static final Uri SMS_URI = Uri.parse("content://sms");
+
+    private static class Subscription {
+        long minIntervalMs, lastPushMs;
+        Object lastValue, pendingValue;
+        boolean pushScheduled;
+    }
+
+    private static class Client {
+        SparseArray<Subscription> subscriptions = new SparseArray<>();
+        HashSet<Integer> pushTransactionIds = new HashSet<>();
+        int nackedPushes;
+        BroadcastReceiver ackReceiver, nackReceiver;
+    }
+
+    private final Context context;
+    private final Handler handler = new Handler(Looper.getMainLooper());
+    private final Handler workerHandler;
+    private final HashMap<UUID, Client> clients = new HashMap<>();
+    private int nextTransactionId;
+
+    private BroadcastReceiver batteryReceiver, wifiReceiver, tickReceiver;
+    private ContentObserver smsObserver, calendarObserver;
+    private SignalListener signalListener;
+
+    SubscriptionManager(Context context, Handler workerHandler) {
+        this.context = context;
+        this.workerHandler = workerHandler;
+    }
+
+    /**
+     * Subscribe a watch app to a DataType. response is the reply to the subscription request, which
+     * already holds the current value under AppKeyDataValue.
+     */
+    void subscribe(UUID uuid, int type, long minIntervalMs, PebbleDictionary response) {
+        Client client = clients.get(uuid);
+        if(client == null) {
+            client = new Client();
+            clients.put(uuid, client);
+            registerDeliveryReceivers(uuid, client);
+        }
+
+        Subscription subscription = new Subscription();
+        subscription.minIntervalMs = minIntervalMs;
+        subscription.lastPushMs = System.currentTimeMillis();  // The current value goes in the response
+        subscription.lastValue = valueOf(response);
+        client.subscriptions.put(type, subscription);
+        Log.d(TAG, "Subscribed " + uuid.toString() + " to " + Keys.ReqKeyDataFTypeToString(type));
+
+        updateSources();
+    }
+
+    void unsubscribe(UUID uuid, int type) {
+        Client client = clients.get(uuid);
+        if(client == null) {
+            return;
+        }
+
+        client.subscriptions.remove(type);
+        if(client.subscriptions.size() == 0) {
+            removeClient(uuid);
+        }
+        Log.d(TAG, "Unsubscribed " + uuid.toString() + " from " + Keys.ReqKeyDataFTypeToString(type));
+
+        updateSources();
+    }
+
+    void release() {
+        for(UUID uuid : new ArrayList<>(clients.keySet())) {
+            removeClient(uuid);
+        }
+        updateSources();
+        handler.removeCallbacksAndMessages(null);
+    }
+
+    private void removeClient(UUID uuid) {
+        Client client = clients.remove(uuid);
+        if(client == null) {
+            return;
+        }
+
+        context.unregisterReceiver(client.ackReceiver);
+        context.unregisterReceiver(client.nackReceiver);
+    }
+
+    private boolean isSubscribed(int type) {
+        for(Client client : clients.values()) {
+            if(client.subscriptions.get(type) != null) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    private void updateSources() {
+        // Battery
+        boolean battery = isSubscribed(Keys.DataTypeBatteryPercent);
+        if(battery && batteryReceiver == null) {
+            batteryReceiver = new ChangeReceiver(Keys.DataTypeBatteryPercent);
+            context.registerReceiver(batteryReceiver, new IntentFilter(Intent.ACTION_BATTERY_CHANGED));
+        } else if(!battery && batteryReceiver != null) {
+            context.unregisterReceiver(batteryReceiver);
+            batteryReceiver = null;
+        }
+
+        // Wifi
+        boolean wifi = isSubscribed(Keys.DataTypeWifiNetworkName);
+        if(wifi && wifiReceiver == null) {
+            wifiReceiver = new ChangeReceiver(Keys.DataTypeWifiNetworkName);
+            context.registerReceiver(wifiReceiver, new IntentFilter(WifiManager.NETWORK_STATE_CHANGED_ACTION));
+        } else if(!wifi && wifiReceiver != null) {
+            context.unregisterReceiver(wifiReceiver);
+            wifiReceiver = null;
+        }
+
+        // SMS
+        boolean sms = isSubscribed(Keys.DataTypeUnreadSMSCount);
+        if(sms && smsObserver == null) {
+            smsObserver = new ChangeObserver(Keys.DataTypeUnreadSMSCount);
+            context.getContentResolver().registerContentObserver(SMS_URI, true, smsObserver);
+        } else if(!sms && smsObserver != null) {
+            context.getContentResolver().unregisterContentObserver(smsObserver);
+            smsObserver = null;
+        }
+
+        // Phone
+        boolean phone = isSubscribed(Keys.DataTypeGSMStrength) || isSubscribed(Keys.DataTypeGSMOperatorName);
+        TelephonyManager manager = (TelephonyManager) context.getSystemService(Context.TELEPHONY_SERVICE);
+        if(phone && signalListener == null) {
+            signalListener = new SignalListener() {
+
+                @Override
+                public void onPercentKnown(int percent) {
+                    onValue(Keys.DataTypeGSMStrength, Long.valueOf(percent));
+                }
+
+                @Override
+                public void onServiceStateChanged(ServiceState serviceState) {
+                    super.onServiceStateChanged(serviceState);
+                    onChange(Keys.DataTypeGSMOperatorName);
+                }
+
+            };
+            manager.listen(signalListener,
+                    PhoneStateListener.LISTEN_SIGNAL_STRENGTHS | PhoneStateListener.LISTEN_SERVICE_STATE);
+        } else if(!phone && signalListener != null) {
+            manager.listen(signalListener, PhoneStateListener.LISTEN_NONE);
+            signalListener = null;
+        }
+
+        // Calendar
+        boolean calendar = isSubscribed(Keys.DataTypeNextCalendarEventOneLine)
+                || isSubscribed(Keys.DataTypeNextCalendarEventTwoLine);
+        if(calendar && calendarObserver == null) {
+            calendarObserver = new ContentObserver(handler) {
+
+                @Override
+                public void onChange(boolean selfChange) {
+                    // CalendarManager's own observer may not have been notified yet
+                    CalendarManager.invalidate();
+                    SubscriptionManager.this.onChange(Keys.DataTypeNextCalendarEventOneLine);
+                    SubscriptionManager.this.onChange(Keys.DataTypeNextCalendarEventTwoLine);
+                }
+
+            };
+            context.getContentResolver().registerContentObserver(CalendarContract.CONTENT_URI, true, calendarObserver);
+        } else if(!calendar && calendarObserver != null) {
+            context.getContentResolver().unregisterContentObserver(calendarObserver);
+            calendarObserver = null;
+        }
+
+        // Tick
+        boolean tick = calendar || isSubscribed(Keys.DataTypeStorageFreeGBString)
+                || isSubscribed(Keys.DataTypeStoragePercentUsed);
+        if(tick && tickReceiver == null) {
+            tickReceiver = new BroadcastReceiver() {
+
+                @Override
+                public void onReceive(Context context, Intent intent) {
+                    onChange(Keys.DataTypeStorageFreeGBString);
+                    onChange(Keys.DataTypeStoragePercentUsed);
+                    onChange(Keys.DataTypeNextCalendarEventOneLine);
+                    onChange(Keys.DataTypeNextCalendarEventTwoLine);
+                }
+
+            };
+            context.registerReceiver(tickReceiver, new IntentFilter(Intent.ACTION_TIME_TICK));
+        } else if(!tick && tickReceiver != null) {
+            context.unregisterReceiver(tickReceiver);
+            tickReceiver = null;
+        }
+    }
+
+    private class ChangeReceiver extends BroadcastReceiver {
+
+        private final int type;
+
+        ChangeReceiver(int type) {
+            this.type = type;
+        }
+
+        @Override
+        public void onReceive(Context context, Intent intent) {
+            // ValueCache's own receiver may not have been notified yet
+            if(type == Keys.DataTypeBatteryPercent) {
+                ValueCache.onBatteryChanged(intent);
+            }
+            onChange(type);
+        }
+
+    }
+
+    private class ChangeObserver extends ContentObserver {
+
+        private final int type;
+
+        ChangeObserver(int type) {
+            super(handler);
+            this.type = type;
+        }
+
+        @Override
+        public void onChange(boolean selfChange) {
+            // As for ChangeReceiver
+            if(type == Keys.DataTypeUnreadSMSCount) {
+                ValueCache.invalidateSms();
+            }
+            SubscriptionManager.this.onChange(type);
+        }
+
+    }
+
+    private static Object valueOf(PebbleDictionary dict) {
+        Long integer = dict.getInteger(Keys.AppKeyDataValue);
+        return (integer != null) ? integer : dict.getString(Keys.AppKeyDataValue);
+    }
+
+    private Object getValue(int type) {
+        PebbleDictionary dict = new PebbleDictionary();
+        APIHandler.handleGetData(context, type, Keys.AppKeyDataValue, true, dict);   // Subscriptions are from 1.8
+        return valueOf(dict);
+    }
+
+    // Look up the value on the worker thread, then offer it to subscribers back on this one
+    private void onChange(final int type) {
+        if(!isSubscribed(type)) {
+            return;
+        }
+
+        workerHandler.post(new Runnable() {
+
+            @Override
+            public void run() {
+                final Object value = getValue(type);
+                handler.post(new Runnable() {
+
+                    @Override
+                    public void run() {
+                        onValue(type, value);
+                    }
+
+                });
+            }
+
+        });
+    }
+
+    private void onValue(int type, Object value) {
+        if(value == null) {
+            return;
+        }
+
+        for(UUID uuid : clients.keySet()) {
+            Subscription subscription = clients.get(uuid).subscriptions.get(type);
+            if(subscription != null) {
+                offer(uuid, type, subscription, value);
+            }
+        }
+    }
+
+    // Push if changed, or schedule for when the minimum interval has elapsed
+    private void offer(final UUID uuid, final int type, final Subscription subscription, Object value) {
+        subscription.pendingValue = value;
+        if(value.equals(subscription.lastValue) || subscription.pushScheduled) {
+            return;
+        }
+
+        long wait = subscription.lastPushMs + subscription.minIntervalMs - System.currentTimeMillis();
+        if(wait <= 0) {
+            push(uuid, type, subscription);
+            return;
+        }
+
+        subscription.pushScheduled = true;
+        handler.postDelayed(new Runnable() {
+
+            @Override
+            public void run() {
+                subscription.pushScheduled = false;
+                if(!subscription.pendingValue.equals(subscription.lastValue)) {
+                    push(uuid, type, subscription);
+                }
+            }
+
+        }, wait);
+    }
+
+    private void push(UUID uuid, int type, Subscription subscription) {
+        Client client = clients.get(uuid);
+        if(client == null || client.subscriptions.get(type) != subscription) {
+            return;
+        }
+
+        Object value = subscription.pendingValue;
+        PebbleDictionary out = new PebbleDictionary();
+        out.addInt32(Keys.RequestTypeGetData, 0);
+        out.addInt32(Keys.AppKeyDataType, type);
+        if(value instanceof Long) {
+            out.addInt32(Keys.AppKeyDataValue, ((Long) value).intValue());
+        } else {
+            out.addString(Keys.AppKeyDataValue, (String) value);
+        }
+        out.addInt32(Keys.AppKeyPush, 0);
+
+        int transactionId = nextTransactionId;
+        nextTransactionId = (nextTransactionId + 1) % 256;
+        client.pushTransactionIds.add(transactionId);
+        PebbleKit.sendDataToPebbleWithTransactionId(context, uuid, out, transactionId);
+
+        subscription.lastValue = value;
+        subscription.lastPushMs = System.currentTimeMillis();
+        Log.d(TAG, "Pushed " + Keys.ReqKeyDataFTypeToString(type) + " to " + uuid.toString());
+    }
+
+    // Drop a client's subscriptions when it repeatedly fails to receive pushes, as it is no longer running
+    private void registerDeliveryReceivers(final UUID uuid, final Client client) {
+        client.ackReceiver = PebbleKit.registerReceivedAckHandler(context, new PebbleKit.PebbleAckReceiver(uuid) {
+
+            @Override
+            public void receiveAck(Context context, int transactionId) {
+                if(client.pushTransactionIds.remove(transactionId)) {
+                    client.nackedPushes = 0;
+                }
+            }
+
+        });
+        client.nackReceiver = PebbleKit.registerReceivedNackHandler(context, new PebbleKit.PebbleNackReceiver(uuid) {
+
+            @Override
+            public void receiveNack(Context context, int transactionId) {
+                if(!client.pushTransactionIds.remove(transactionId)) {
+                    return;
+                }
+
+                client.nackedPushes++;
+                if(client.nackedPushes >= MAX_NACKED_PUSHES) {
+                    Log.d(TAG, "Dropping subscriptions of " + uuid.toString() + " after NACKed pushes");
+                    removeClient(uuid);
+                    updateSources();
+                }
+            }
+
+        });
+    }
+
+}
@@ -0,0 +1,177 @@
+package dash;
+
+import android.content.BroadcastReceiver;
+import android.content.Context;
+import android.content.Intent;
+import android.content.IntentFilter;
+import android.database.ContentObserver;
+import android.database.Cursor;
+import android.net.Uri;
+import android.os.BatteryManager;
+import android.os.Environment;
+import android.os.StatFs;
+import android.provider.BaseColumns;
+import android.util.Log;
+
+/**
+ * Values of the DataTypes that are costly to look up, kept so that most requests are answered from memory:
+ *   Battery - kept current by a receiver for ACTION_BATTERY_CHANGED
+ *   SMS     - the unread count, queried again after a ContentObserver on content://sms reports a change
+ *   Storage - StatFs values, looked up again once older than STORAGE_TTL_MS
+ * The receiver and observer are registered on first use, and removed by release(). Only registration takes the
+ * class lock. Values are volatile and looked up outside it, so that invalidation and battery updates on the main
+ * thread never wait for a query.
+ */
+class ValueCache {
+
+    private static final String TAG = ValueCache.class.getName();
+
+    private static final long STORAGE_TTL_MS = 30 * 1000L;
+
+    private static final Uri SMS_URI = Uri.parse("content://sms");
+    private static final Uri SMS_INBOX_URI = Uri.parse("content://sms/inbox");
+    private static final String[] SMS_PROJECTION = new String[]{ BaseColumns._ID };
+
+    private static Context appContext;
+    private static BroadcastReceiver batteryReceiver;
+    private static ContentObserver smsObserver;
+
+    private static class Storage {
+        final long free, total, queryMs;
+
+        Storage(long free, long total, long queryMs) {
+            this.free = free;
+            this.total = total;
+            this.queryMs = queryMs;
+        }
+    }
+
+    private static volatile int batteryPercent = -1;
+    private static volatile int unreadSms;
+    private static volatile boolean unreadSmsValid;
+    private static volatile Storage storage;
+
+    public static int getBatteryPercent(Context context) {
+        registerBatteryReceiver(context);
+        return batteryPercent;
+    }
+
+    private static synchronized void registerBatteryReceiver(Context context) {
+        if(batteryReceiver != null) {
+            return;
+        }
+
+        appContext = context.getApplicationContext();
+        batteryReceiver = new BroadcastReceiver() {
+
+            @Override
+            public void onReceive(Context context, Intent intent) {
+                onBatteryChanged(intent);
+            }
+
+        };
+
+        // The intent is sticky, so the current value is returned at once
+        onBatteryChanged(appContext.registerReceiver(batteryReceiver,
+                new IntentFilter(Intent.ACTION_BATTERY_CHANGED)));
+    }
+
+    /**
+     * Update the battery value from an ACTION_BATTERY_CHANGED intent, for receivers that may be notified
+     * before this one.
+     */
+    public static void onBatteryChanged(Intent intent) {
+        if(intent == null) {
+            return;
+        }
+
+        int level = intent.getIntExtra(BatteryManager.EXTRA_LEVEL, -1);
+        int scale = intent.getIntExtra(BatteryManager.EXTRA_SCALE, -1);
+        batteryPercent = Math.round(((float)level / (float)scale) * 100.0F);
+    }
+
+    public static int getUnreadSmsCount(Context context) {
+        registerSmsObserver(context);
+        if(!unreadSmsValid) {
+            // Marked valid before the query, so that an invalidation while it runs causes another
+            unreadSmsValid = true;
+            try {
+                // Only the count is needed, so fetch no more than the row IDs
+                Cursor c = appContext.getContentResolver().query(SMS_INBOX_URI, SMS_PROJECTION, "read = 0", null, null);
+                unreadSms = c.getCount();
+                c.close();
+            } catch(Exception e) {
+                unreadSmsValid = false;
+                Log.e(TAG, "Exception getting unread SMS: " + e.getLocalizedMessage());
+                e.printStackTrace();
+            }
+        }
+        return unreadSms;
+    }
+
+    private static synchronized void registerSmsObserver(Context context) {
+        if(smsObserver != null) {
+            return;
+        }
+
+        appContext = context.getApplicationContext();
+        smsObserver = new ContentObserver(null) {
+
+            @Override
+            public void onChange(boolean selfChange) {
+                invalidateSms();
+            }
+
+        };
+        appContext.getContentResolver().registerContentObserver(SMS_URI, true, smsObserver);
+    }
+
+    public static void invalidateSms() {
+        unreadSmsValid = false;
+    }
+
+    /**
+     * Free bytes of external storage.
+     */
+    public static long getStorageFree() {
+        return getStorage().free;
+    }
+
+    /**
+     * Total bytes of external storage.
+     */
+    public static long getStorageTotal() {
+        return getStorage().total;
+    }
+
+    private static Storage getStorage() {
+        Storage current = storage;
+        long now = System.currentTimeMillis();
+        if(current != null && now - current.queryMs < STORAGE_TTL_MS) {
+            return current;
+        }
+
+        StatFs statFs = new StatFs(Environment.getExternalStorageDirectory().getAbsolutePath());
+        current = new Storage(statFs.getFreeBlocksLong() * statFs.getBlockSizeLong(),
+                statFs.getBlockCountLong() * statFs.getBlockSizeLong(), now);
+        storage = current;
+        return current;
+    }
+
+    /**
+     * Unregister the receiver and observer, and forget the values they kept current.
+     */
+    public static synchronized void release() {
+        if(batteryReceiver != null) {
+            appContext.unregisterReceiver(batteryReceiver);
+            batteryReceiver = null;
+            batteryPercent = -1;
+        }
+        if(smsObserver != null) {
+            appContext.getContentResolver().unregisterContentObserver(smsObserver);
+            smsObserver = null;
+            unreadSmsValid = false;
+        }
+    }
+
+}
@@ -2,17 +2,21 @@ package data;
 
 import android.content.ContentUris;
 import android.content.Context;
+import android.database.ContentObserver;
 import android.database.Cursor;
 import android.net.Uri;
 import android.provider.CalendarContract;
 import android.util.Log;
 
-import java.util.ArrayList;
-import java.util.Collections;
-import java.util.Comparator;
+import java.util.ArrayDeque;
 
 /**
  * Adapted from http://www.grokkingandroid.com/androids-calendarcontract-provider/
+ *
+ * Upcoming event instances are kept in an index ordered by start time, so that the next event is
+ * the head of the index once those that have ended are dropped. The index is rebuilt only when the
+ * calendar provider reports a change, or when it has emptied. Lookups hold the class lock while they
+ * query, but invalidate() does not take it, so the main thread never waits for a query.
  */
 public class CalendarManager {
 
@@ -21,6 +25,9 @@ public class CalendarManager {
     public static final long MILLIS_PER_HOUR = 1000 * 60 * 60L;
     public static final int HOURS_AHEAD = 24;
 
+    // Minimum time between queries while there are no upcoming events
+    private static final long EMPTY_REQUERY_MS = 60 * 1000L;
+
     private static final String[] INSTANCE_PROJECTION = new String[]{
             CalendarContract.Instances.EVENT_ID,
             CalendarContract.Instances.BEGIN,
@@ -30,52 +37,99 @@ public class CalendarManager {
             CalendarContract.Instances.DISPLAY_COLOR,
     };
 
+    // Indices into INSTANCE_PROJECTION
+    private static final int
+            PROJECTION_BEGIN_INDEX = 1,
+            PROJECTION_END_INDEX = 2,
+            PROJECTION_TITLE_INDEX = 3;
+
+    private static final ArrayDeque<Event> index = new ArrayDeque<Event>();
+    private static volatile boolean indexValid;
+    private static long indexQueryMs;
+    private static Context appContext;
+    private static ContentObserver observer;
+
     /**
      * http://www.programcreek.com/java-api-examples/index.php?source_dir=clockwise-master/ustwo-clockwise-wearable/src/main/java/com/ustwo/clockwise/data/calendar/CalendarWatchFaceHelper.java
      */
-    public static Event getNextCalendarEvent(Context context) {
+    public static synchronized Event getNextCalendarEvent(Context context) {
+        if(observer == null) {
+            appContext = context.getApplicationContext();
+            observer = new ContentObserver(null) {
+
+                @Override
+                public void onChange(boolean selfChange) {
+                    invalidate();
+                }
+
+            };
+            appContext.getContentResolver().registerContentObserver(CalendarContract.CONTENT_URI, true, observer);
+        }
+
+        // Drop events that have ended
+        long now = System.currentTimeMillis();
+        while(!index.isEmpty() && index.peekFirst().end <= now) {
+            index.removeFirst();
+        }
+
+        // Events not in the index start after all of those that are, so the index only needs rebuilding
+        // once it is empty
+        if(!indexValid || (index.isEmpty() && now - indexQueryMs >= EMPTY_REQUERY_MS)) {
+            query(context, now);
+        }
+
+        return index.peekFirst();
+    }
+
+    /**
+     * Discard the index, so the next lookup queries the calendar provider again. A query already running marked
+     * the index valid before it began, so it is queried again after that too.
+     */
+    public static void invalidate() {
+        indexValid = false;
+    }
+
+    /**
+     * Unregister the observer, and forget the index it kept current.
+     */
+    public static synchronized void release() {
+        if(observer != null) {
+            appContext.getContentResolver().unregisterContentObserver(observer);
+            observer = null;
+        }
+        index.clear();
+        indexValid = false;
+    }
+
+    private static void query(Context context, long now) {
+        index.clear();
+        indexValid = true;
+        indexQueryMs = now;
+
         Uri.Builder builder = CalendarContract.Instances.CONTENT_URI.buildUpon();
-        long queryStartMs = System.currentTimeMillis();
+        long queryStartMs = now;
         long queryEndMs = queryStartMs + (MILLIS_PER_HOUR * HOURS_AHEAD);
         ContentUris.appendId(builder, queryStartMs);
-        ContentUris.appendId(builder, queryStartMs + queryEndMs);
+        ContentUris.appendId(builder, queryEndMs);
 
-        final Cursor cursor = context.getContentResolver().query(builder.build(), INSTANCE_PROJECTION, null, null, null);
+        final Cursor cursor = context.getContentResolver().query(builder.build(), INSTANCE_PROJECTION, null, null,
+                CalendarContract.Instances.BEGIN + " ASC");
         if (cursor == null) {
             Log.e(TAG, "Error getting Calendar events.");
-            return null;
+            return;
         }
 
-        // Build events in next hours
-        ArrayList<Event> events = new ArrayList<Event>();
+        // Build events in next hours, in order of start
         while (cursor.moveToNext()) {
             Event e = new Event();
-            e.title = cursor.getString(cursor.getColumnIndex(CalendarContract.Instances.TITLE));
-            e.start = cursor.getLong(cursor.getColumnIndex(CalendarContract.Instances.BEGIN));
-            e.end = cursor.getLong(cursor.getColumnIndex(CalendarContract.Instances.END));
-            if(e.isSoon()) {
-                events.add(e);
+            e.title = cursor.getString(PROJECTION_TITLE_INDEX);
+            e.start = cursor.getLong(PROJECTION_BEGIN_INDEX);
+            e.end = cursor.getLong(PROJECTION_END_INDEX);
+            if(e.end > now) {
+                index.addLast(e);
             }
         }
         cursor.close();
-
-        if(events.size() > 0) {
-            // Compare and pick next upcoming
-            Collections.sort(events, new Comparator<Event>() {
-
-                @Override
-                public int compare(Event lhs, Event rhs) {
-                    return Long.compare(lhs.start, rhs.start);
-                }
-
-            });
-
-            return events.get(0);
-        } else {
-            return null;
-        }
     }
 
-
-
-}
\ No newline at end of file
+}
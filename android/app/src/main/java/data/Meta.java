@@ -8,7 +8,7 @@ public class Meta {
 
     private static final int
         VERSION_MAJOR = 1,
-        VERSION_MINOR = 7;  // 1.7
+        VERSION_MINOR = 8;  // 1.8
 
     public static boolean isRemoteCompatible(String remoteVersion) {
         int remoteMajor = Integer.parseInt(remoteVersion.substring(0, remoteVersion.indexOf('.')));
@@ -28,6 +28,15 @@ public class Meta {
         return minorCompatible;
     }
 
+    /**
+     * Whether a compatible remote version is the given one or later.
+     */
+    public static boolean isRemoteAtLeast(String remoteVersion, int major, int minor) {
+        int remoteMajor = Integer.parseInt(remoteVersion.substring(0, remoteVersion.indexOf('.')));
+        int remoteMinor = Integer.parseInt(remoteVersion.substring(remoteVersion.indexOf('.') + 1));
+        return remoteMajor > major || (remoteMajor == major && remoteMinor >= minor);
+    }
+
     public static String getVersionString() {
         return "" + VERSION_MAJOR + "." + VERSION_MINOR;
     }
@@ -5,6 +5,8 @@ import android.content.SharedPreferences;
 import android.preference.PreferenceManager;
 
 import java.util.ArrayList;
+import java.util.LinkedHashMap;
+import java.util.Map;
 import java.util.UUID;
 
 /**
@@ -16,6 +18,8 @@ import java.util.UUID;
  * K-V: LIST -> uuid;uuid;uuid;...
  * Single list:
  * K-V: LIST -> uuid
+ *
+ * These are loaded into memory once, and only changed values are written back, asynchronously.
  */
 public class PermissionManager {
 
@@ -29,87 +33,108 @@ public class PermissionManager {
     private static final String
         LIST_SEP = ";";
 
-    public static boolean isPermitted(Context context, UUID uuid) {
+    private static class Entry {
+        String name;        // null if not yet stored
+        boolean permitted;
+        boolean listed;     // In LIST, as apps are once their permission has been set
+    }
+
+    // In LIST order, followed by any apps not yet listed
+    private static LinkedHashMap<UUID, Entry> registry;
+
+    private static synchronized LinkedHashMap<UUID, Entry> load(Context context) {
+        if(registry != null) {
+            return registry;
+        }
+
+        registry = new LinkedHashMap<>();
         SharedPreferences prefs = PreferenceManager.getDefaultSharedPreferences(context);
-        String uuidPermString = KEY_PERMITTED + uuid.toString();
-        if(!prefs.contains(uuidPermString)) {
-            //Log.d(TAG, "Permission string does not yet exist");
-            return false;
+        String listEncoded = prefs.getString(KEY_LIST, "");
+        if(listEncoded.length() > 0) {
+            for(String item : listEncoded.split(LIST_SEP)) {
+                getEntry(UUID.fromString(item)).listed = true;
+            }
+        }
+
+        for(Map.Entry<String, ?> pref : prefs.getAll().entrySet()) {
+            String key = pref.getKey();
+            if(key.startsWith(KEY_NAME)) {
+                getEntry(UUID.fromString(key.substring(KEY_NAME.length()))).name = (String) pref.getValue();
+            } else if(key.startsWith(KEY_PERMITTED)) {
+                getEntry(UUID.fromString(key.substring(KEY_PERMITTED.length()))).permitted = (Boolean) pref.getValue();
+            }
         }
-        boolean permitted = prefs.getBoolean(uuidPermString, false);
-        //Log.d(TAG, "Permitted? " + permitted);
-        return permitted;
+        return registry;
     }
 
-    public static void setName(Context context, UUID uuid, String name) {
-        SharedPreferences.Editor ed = PreferenceManager.getDefaultSharedPreferences(context).edit();
-        String uuidKeyString = KEY_NAME + uuid.toString();
-        ed.putString(uuidKeyString, name);
-        ed.commit();
-        //Log.d(TAG, "Name set to " + name);
+    private static Entry getEntry(UUID uuid) {
+        Entry entry = registry.get(uuid);
+        if(entry == null) {
+            entry = new Entry();
+            registry.put(uuid, entry);
+        }
+        return entry;
     }
 
-    public static String getName(Context context, UUID uuid) {
-        SharedPreferences prefs = PreferenceManager.getDefaultSharedPreferences(context);
-        String uuidKeyString = KEY_NAME + uuid.toString();
-        if(!prefs.contains(uuidKeyString)) {
-            //Log.d(TAG, "Name not yet stored");
-            return null;
+    public static synchronized boolean isPermitted(Context context, UUID uuid) {
+        Entry entry = load(context).get(uuid);
+        return entry != null && entry.permitted;
+    }
+
+    public static synchronized void setName(Context context, UUID uuid, String name) {
+        load(context);
+        Entry entry = getEntry(uuid);
+        if(name == null ? entry.name == null : name.equals(entry.name)) {
+            return;
         }
-        String name = prefs.getString(uuidKeyString, "Unknown app");
-        //Log.d(TAG, "Got name " + name);
-        return name;
+
+        entry.name = name;
+        SharedPreferences.Editor ed = PreferenceManager.getDefaultSharedPreferences(context).edit();
+        ed.putString(KEY_NAME + uuid.toString(), name);
+        ed.apply();
+    }
+
+    public static synchronized String getName(Context context, UUID uuid) {
+        Entry entry = load(context).get(uuid);
+        return (entry != null) ? entry.name : null;
     }
     
-    public static void setPermitted(Context context, UUID uuid, boolean permitted) {
-        SharedPreferences prefs = PreferenceManager.getDefaultSharedPreferences(context);
-        String uuidString = uuid.toString();
+    public static synchronized void setPermitted(Context context, UUID uuid, boolean permitted) {
+        load(context);
+        Entry entry = getEntry(uuid);
+        if(entry.listed && entry.permitted == permitted) {
+            return;
+        }
 
         // Save
-        SharedPreferences.Editor ed = prefs.edit();
-        ed.putBoolean(KEY_PERMITTED + uuidString, permitted);
+        entry.permitted = permitted;
+        SharedPreferences.Editor ed = PreferenceManager.getDefaultSharedPreferences(context).edit();
+        ed.putBoolean(KEY_PERMITTED + uuid.toString(), permitted);
 
         // Add to list
-        if(!prefs.contains(KEY_LIST)) {
-            // First app!
+        if(!entry.listed) {
+            entry.listed = true;
             StringBuilder builder = new StringBuilder();
-            builder.append(uuidString);
+            for(Map.Entry<UUID, Entry> listed : registry.entrySet()) {
+                if(listed.getValue().listed) {
+                    if(builder.length() > 0) {
+                        builder.append(LIST_SEP);
+                    }
+                    builder.append(listed.getKey().toString());
+                }
+            }
             ed.putString(KEY_LIST, builder.toString());
-            ed.commit();
-
-            //Log.d(TAG, "The first app: " + builder.toString());
-            return;
-        }
-
-        // Already exist?
-        String list = prefs.getString(KEY_LIST, "");
-        if(list.contains(uuidString)) {
-            //Log.d(TAG, "uuid " + uuidString + " is already in LIST " + list);
-            ed.commit();
-            return;
         }
-
-        // Append
-        list = list + LIST_SEP + uuidString;
-        ed.putString(KEY_LIST, list);
-        ed.commit();
-        //Log.d(TAG, "LIST now " + list);
+        ed.apply();
     }
 
-    public static ArrayList<UUID> getList(Context context) {
-        SharedPreferences prefs = PreferenceManager.getDefaultSharedPreferences(context);
+    public static synchronized ArrayList<UUID> getList(Context context) {
         ArrayList<UUID> list = new ArrayList<>();
-        if(!prefs.contains(KEY_LIST)) {
-            return list;
+        for(Map.Entry<UUID, Entry> entry : load(context).entrySet()) {
+            if(entry.getValue().listed) {
+                list.add(entry.getKey());
+            }
         }
-
-        String listEncoded = prefs.getString(KEY_LIST, "");
-        String[] items = listEncoded.split(";");
-        for(int i = 0; i < items.length; i++) {
-            //Log.d(TAG, "Read UUID " + items[i]);
-            list.add(UUID.fromString(items[i]));
-        }
-
         return list;
     }
 
@@ -0,0 +1,19 @@
+#pragma once
+
+// Stand-in for the pebble-events package, implemented by src/sim.c
+
+#include <pebble.h>
+
+typedef void* EventHandle;
+
+EventHandle events_app_message_register_inbox_received(AppMessageInboxReceived received_callback, void *context);
+EventHandle events_app_message_register_outbox_sent(AppMessageOutboxSent sent_callback, void *context);
+EventHandle events_app_message_register_outbox_failed(AppMessageOutboxFailed failed_callback, void *context);
+void events_app_message_request_inbox_size(uint32_t size);
+void events_app_message_request_outbox_size(uint32_t size);
+AppMessageResult events_app_message_open(void);
+
+EventHandle events_connection_service_subscribe(ConnectionHandlers conn_handlers);
+
+EventHandle events_tick_timer_service_subscribe(TimeUnits tick_units, TickHandler handler);
+void events_tick_timer_service_unsubscribe(EventHandle handle);
@@ -0,0 +1,12 @@
+#pragma once
+
+// Stand-in for the pebble-packet package, implemented by src/sim.c
+
+#include <pebble.h>
+
+typedef void(PacketFailedCallback)(void);
+
+bool packet_begin();
+bool packet_put_integer(int key, int value);
+bool packet_put_string(int key, char *string);
+bool packet_send(PacketFailedCallback *failed_callback);
@@ -0,0 +1,165 @@
+#pragma once
+
+// Stand-in for the parts of the Pebble SDK used by pebble-dash-api, implemented by src/sim.c on top of a
+// simulated clock, heap and Bluetooth link.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*********************************** Heap *************************************/
+
+// Allocations made by the library count towards the heap high-water mark, and are counted in SimStats
+void* sim_malloc(size_t size);
+void* sim_calloc(size_t count, size_t size);
+void* sim_realloc(void *ptr, size_t size);
+void sim_free(void *ptr);
+
+#if !defined(SIM_INTERNAL)
+#define malloc(size)         sim_malloc(size)
+#define calloc(count, size)  sim_calloc(count, size)
+#define realloc(ptr, size)   sim_realloc(ptr, size)
+#define free(ptr)            sim_free(ptr)
+#endif
+
+/*********************************** Time *************************************/
+
+time_t sim_time(time_t *tloc);
+uint16_t time_ms(time_t *tloc, uint16_t *out_ms);
+
+#if !defined(SIM_INTERNAL)
+#define time(tloc) sim_time(tloc)
+#endif
+
+typedef enum {
+  SECOND_UNIT = 1 << 0,
+  MINUTE_UNIT = 1 << 1,
+  HOUR_UNIT = 1 << 2,
+  DAY_UNIT = 1 << 3,
+  MONTH_UNIT = 1 << 4,
+  YEAR_UNIT = 1 << 5
+} TimeUnits;
+
+typedef void (*TickHandler)(struct tm *tick_time, TimeUnits units_changed);
+
+typedef struct AppTimer AppTimer;
+typedef void (*AppTimerCallback)(void *data);
+
+AppTimer* app_timer_register(uint32_t timeout_ms, AppTimerCallback callback, void *callback_data);
+bool app_timer_reschedule(AppTimer *timer_handle, uint32_t new_timeout_ms);
+void app_timer_cancel(AppTimer *timer_handle);
+
+/********************************* Logging ************************************/
+
+#define APP_LOG_LEVEL_ERROR         1
+#define APP_LOG_LEVEL_WARNING       50
+#define APP_LOG_LEVEL_INFO          100
+#define APP_LOG_LEVEL_DEBUG         200
+#define APP_LOG_LEVEL_DEBUG_VERBOSE 255
+
+void app_log(uint8_t log_level, const char *src_filename, int src_line_number, const char *fmt, ...)
+  __attribute__((format(printf, 4, 5)));
+
+#define APP_LOG(level, fmt, args...) app_log(level, __FILE__, __LINE__, fmt, ## args)
+
+/******************************** Dictionary **********************************/
+
+typedef enum {
+  TUPLE_BYTE_ARRAY = 0,
+  TUPLE_CSTRING = 1,
+  TUPLE_UINT = 2,
+  TUPLE_INT = 3
+} TupleType;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t key;
+  TupleType type:8;
+  uint16_t length;
+  union {
+    uint8_t data[0];
+    char cstring[0];
+    uint8_t uint8;
+    uint16_t uint16;
+    uint32_t uint32;
+    int8_t int8;
+    int16_t int16;
+    int32_t int32;
+  } value[];
+} Tuple;
+
+typedef struct {
+  uint8_t count;
+  Tuple head[];
+} __attribute__((__packed__)) Dictionary;
+
+typedef struct {
+  Dictionary *dictionary;
+  const void *end;
+  Tuple *cursor;
+} DictionaryIterator;
+
+typedef enum {
+  DICT_OK = 0,
+  DICT_NOT_ENOUGH_STORAGE = 1 << 1,
+  DICT_INVALID_ARGS = 1 << 2
+} DictionaryResult;
+
+DictionaryResult dict_write_begin(DictionaryIterator *iter, uint8_t * const buffer, const uint16_t size);
+DictionaryResult dict_write_int32(DictionaryIterator *iter, const uint32_t key, const int32_t value);
+DictionaryResult dict_write_data(DictionaryIterator *iter, const uint32_t key, const uint8_t * const data,
+                                 const uint16_t size);
+DictionaryResult dict_write_cstring(DictionaryIterator *iter, const uint32_t key, const char * const cstring);
+uint32_t dict_write_end(DictionaryIterator *iter);
+uint32_t dict_size(DictionaryIterator *iter);
+Tuple* dict_read_begin_from_buffer(DictionaryIterator *iter, const uint8_t * const buffer, const uint16_t size);
+Tuple* dict_read_next(DictionaryIterator *iter);
+Tuple* dict_find(const DictionaryIterator *iter, const uint32_t key);
+
+/******************************** Storage *************************************/
+
+#define PERSIST_DATA_MAX_LENGTH 256
+
+typedef enum {
+  S_TRUE = 1,
+  E_DOES_NOT_EXIST = -9,
+  E_OUT_OF_STORAGE = -11
+} StatusCode;
+
+bool persist_exists(const uint32_t key);
+int persist_read_data(const uint32_t key, void *buffer, const size_t buffer_size);
+int persist_write_data(const uint32_t key, const void *data, const size_t size);
+int persist_delete(const uint32_t key);
+
+/******************************** AppMessage **********************************/
+
+typedef enum {
+  APP_MSG_OK = 0,
+  APP_MSG_SEND_TIMEOUT = 1 << 1,
+  APP_MSG_SEND_REJECTED = 1 << 2,
+  APP_MSG_NOT_CONNECTED = 1 << 3,
+  APP_MSG_BUSY = 1 << 6,
+  APP_MSG_BUFFER_OVERFLOW = 1 << 7,
+  APP_MSG_CLOSED = 1 << 11
+} AppMessageResult;
+
+typedef void (*AppMessageInboxReceived)(DictionaryIterator *iterator, void *context);
+typedef void (*AppMessageOutboxSent)(DictionaryIterator *iterator, void *context);
+typedef void (*AppMessageOutboxFailed)(DictionaryIterator *iterator, AppMessageResult reason, void *context);
+
+AppMessageResult app_message_outbox_begin(DictionaryIterator **iterator);
+AppMessageResult app_message_outbox_send(void);
+
+/******************************** Connection **********************************/
+
+typedef void (*ConnectionHandler)(bool connected);
+
+typedef struct {
+  ConnectionHandler pebble_app_connection_handler;
+  ConnectionHandler pebblekit_connection_handler;
+} ConnectionHandlers;
+
+bool connection_service_peek_pebble_app_connection(void);
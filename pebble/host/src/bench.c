@@ -0,0 +1,328 @@
+#include "sim.h"
+
+#include <pebble-dash-api.h>
+#include <pebble-events/pebble-events.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Benchmarks of typical refresh workloads over the simulated link. Each workload runs in its own process, so
+// that the library starts from its initial state.
+
+#define MAX_SAMPLES   4096
+#define ROUND_LIMIT_MS 120000  // A round still running after this long is abandoned
+#define PERSIST_KEY   1000
+
+// Workload options
+#define PACKED  (1 << 0)   // Use dash_api_set_packed_format()
+#define PERSIST (1 << 1)   // Use dash_api_persist_values()
+#define MINUTES (1 << 2)   // Run each round for a minute, rather than until idle
+
+// One request, from the API call until its last value is delivered
+typedef struct {
+  uint32_t start_ms;
+  int pending;   // Values or feature states still to be delivered
+} Sample;
+
+typedef struct {
+  const char *name;
+  const char *description;
+  SimLinkConfig link;
+  int rounds;
+  void (*start_round)(void);
+  int options;
+} Workload;
+
+static Sample s_samples[MAX_SAMPLES];
+static int s_latencies[MAX_SAMPLES];
+static int s_num_samples, s_num_latencies;
+
+/********************************* Samples ************************************/
+
+static Sample* sample_begin(int pending) {
+  if(s_num_samples == MAX_SAMPLES) {
+    fprintf(stderr, "bench: More than %d requests in a workload\n", MAX_SAMPLES);
+    exit(1);
+  }
+
+  Sample *sample = &s_samples[s_num_samples++];
+  sample->start_ms = sim_now_ms();
+  sample->pending = pending;
+  return sample;
+}
+
+static void sample_deliver(Sample *sample) {
+  if(sample->pending > 0 && --sample->pending == 0) {
+    s_latencies[s_num_latencies++] = sim_now_ms() - sample->start_ms;
+  }
+}
+
+static void data_callback(DataType type, DataValue value, void *context) {
+  sample_deliver(context);
+}
+
+static void feature_callback(FeatureType type, FeatureState state, void *context) {
+  sample_deliver(context);
+}
+
+static void error_callback(ErrorCode code) {
+  // Requests that fail are counted as those whose values never arrive
+}
+
+/******************************** Workloads ***********************************/
+
+static const DataType s_refresh_types[] = {
+  DataTypeBatteryPercent,
+  DataTypeGSMStrength,
+  DataTypeWifiNetworkName,
+  DataTypeNextCalendarEventOneLine
+};
+#define NUM_REFRESH_TYPES (int)(sizeof(s_refresh_types) / sizeof(DataType))
+
+static void get_data(DataType type) {
+  dash_api_get_data_with_context(type, data_callback, sample_begin(1));
+}
+
+// A watchface checking the phone battery
+static void single_round(void) {
+  get_data(DataTypeBatteryPercent);
+}
+
+// A watchface refreshing each of its widgets
+static void refresh_round(void) {
+  for(int i = 0; i < NUM_REFRESH_TYPES; i++) {
+    get_data(s_refresh_types[i]);
+  }
+}
+
+static void reconnect(void *context) {
+  sim_set_connected(true);
+}
+
+// As refresh_round(), made during a 1.5 s Bluetooth outage
+static void outage_round(void) {
+  sim_set_connected(false);
+  app_timer_register(1500, reconnect, NULL);
+  refresh_round();
+}
+
+// As refresh_round(), in one request
+static void refresh_batch_round(void) {
+  dash_api_get_data_batch_with_context(s_refresh_types, NUM_REFRESH_TYPES, data_callback,
+                                       sample_begin(NUM_REFRESH_TYPES));
+}
+
+// A control app reading and toggling features
+static void features_round(void) {
+  dash_api_get_feature_with_context(FeatureTypeWifi, feature_callback, sample_begin(1));
+  dash_api_set_feature_with_context(FeatureTypeRinger, FeatureStateRingerVibrate, feature_callback, sample_begin(1));
+  dash_api_get_feature_with_context(FeatureTypeBluetooth, feature_callback, sample_begin(1));
+}
+
+// A night mode profile, set one feature at a time
+static void profile_round(void) {
+  dash_api_set_feature_with_context(FeatureTypeWifi, FeatureStateOff, feature_callback, sample_begin(1));
+  dash_api_set_feature_with_context(FeatureTypeRinger, FeatureStateRingerVibrate, feature_callback, sample_begin(1));
+  dash_api_set_feature_with_context(FeatureTypeAutoSync, FeatureStateOff, feature_callback, sample_begin(1));
+  dash_api_set_feature_with_context(FeatureTypeAutoBrightness, FeatureStateOn, feature_callback, sample_begin(1));
+}
+
+// As profile_round(), in one request
+static void profile_batch_round(void) {
+  static const FeatureType types[] = {
+    FeatureTypeWifi, FeatureTypeRinger, FeatureTypeAutoSync, FeatureTypeAutoBrightness
+  };
+  static const FeatureState states[] = {
+    FeatureStateOff, FeatureStateRingerVibrate, FeatureStateOff, FeatureStateOn
+  };
+  dash_api_set_features_with_context(types, states, 4, feature_callback, sample_begin(4));
+}
+
+// A user toggling a feature while a watchface polls in the background. Only the toggle is measured.
+static void toggle_round(void) {
+  for(int type = DataTypeStoragePercentUsed; type <= DataTypeNextCalendarEventTwoLine; type++) {
+    dash_api_get_data(type, NULL);
+  }
+  dash_api_set_feature_with_context(FeatureTypeWifi, FeatureStateOn, feature_callback, sample_begin(1));
+}
+
+// Widgets refreshing periodically, each with a timer of its own
+typedef struct {
+  DataType type;
+  int period_s;
+} Periodic;
+
+static const Periodic s_periodic[] = {
+  { DataTypeBatteryPercent,           60 },
+  { DataTypeGSMStrength,              120 },
+  { DataTypeWifiNetworkName,          300 },
+  { DataTypeNextCalendarEventOneLine, 300 }
+};
+#define NUM_PERIODIC (int)(sizeof(s_periodic) / sizeof(Periodic))
+
+static void periodic_timer_callback(void *data) {
+  const Periodic *periodic = data;
+  get_data(periodic->type);
+  app_timer_register(periodic->period_s * 1000, periodic_timer_callback, data);
+}
+
+static void periodic_round(void) {
+  static bool s_started;
+  if(!s_started) {
+    s_started = true;
+    for(int i = 0; i < NUM_PERIODIC; i++) {
+      app_timer_register(sim_random(s_periodic[i].period_s * 1000), periodic_timer_callback, (void*)&s_periodic[i]);
+    }
+  }
+}
+
+// Values from the scheduler are not requested by the app, so count only their delivery
+static void scheduled_callback(DataType type, DataValue value, void *context) {
+  sample_deliver(sample_begin(1));
+}
+
+// As periodic_round(), with dash_api_schedule()
+static void scheduled_round(void) {
+  static bool s_started;
+  if(!s_started) {
+    s_started = true;
+    for(int i = 0; i < NUM_PERIODIC; i++) {
+      dash_api_schedule_with_context(s_periodic[i].type, s_periodic[i].period_s, scheduled_callback, NULL);
+    }
+  }
+}
+
+// As many requests as can be queued at once, more than can be in flight together
+static void burst_round(void) {
+  for(int type = DataTypeBatteryPercent; type < DataTypeNextCalendarEventTwoLine; type++) {
+    get_data(type);
+  }
+}
+
+#define LINK_GOOD  { .latency_ms = 30, .jitter_ms = 10, .ack_timeout_ms = 3000, .phone_ms = 20, .phone_jitter_ms = 10 }
+#define LINK_LOSSY { .latency_ms = 60, .jitter_ms = 60, .loss_percent = 5, .busy_percent = 10, .ack_timeout_ms = 3000, \
+                     .phone_ms = 40, .phone_jitter_ms = 80 }
+
+static const Workload s_workloads[] = {
+  { "single",          "1 get_data per round",            LINK_GOOD,  500, single_round,         0 },
+  { "refresh",         "4 get_data per round",            LINK_GOOD,  200, refresh_round,        0 },
+  { "refresh-batch",   "1 get_data_batch of 4 per round", LINK_GOOD,  200, refresh_batch_round,  0 },
+  { "refresh-packed",  "refresh, packed format",          LINK_GOOD,  200, refresh_round,        PACKED },
+  { "batch-packed",    "refresh-batch, packed format",    LINK_GOOD,  200, refresh_batch_round,  PACKED },
+  { "refresh-persist", "refresh, persisting values",      LINK_GOOD,  200, refresh_round,        PERSIST },
+  { "batch-persist",   "batch-packed, persisting values", LINK_GOOD,  200, refresh_batch_round,  PACKED | PERSIST },
+  { "features",        "2 get_feature, 1 set_feature",    LINK_GOOD,  200, features_round,       0 },
+  { "profile",         "4 set_feature per round",         LINK_GOOD,  200, profile_round,        0 },
+  { "profile-batch",   "1 set_features of 4 per round",   LINK_GOOD,  200, profile_batch_round,  0 },
+  { "periodic",        "4 widget timers, 1-5 min, 1 hour", LINK_GOOD,  60,  periodic_round,       MINUTES },
+  { "scheduled",       "periodic, with dash_api_schedule", LINK_GOOD,  60,  scheduled_round,      MINUTES },
+  { "toggle-busy",     "1 set_feature behind 5 get_data", LINK_GOOD,  200, toggle_round,         0 },
+  { "burst",           "8 get_data per round",            LINK_GOOD,  100, burst_round,          0 },
+  { "refresh-outage",  "refresh, during a 1.5 s outage",  LINK_GOOD,  200, outage_round,         0 },
+  { "refresh-lossy",   "refresh, 5% loss, 10% busy",      LINK_LOSSY, 200, refresh_round,        0 },
+  { "burst-lossy",     "burst, 5% loss, 10% busy",        LINK_LOSSY, 100, burst_round,          0 }
+};
+#define NUM_WORKLOADS (int)(sizeof(s_workloads) / sizeof(Workload))
+
+/********************************** Report ************************************/
+
+static int compare_ints(const void *a, const void *b) {
+  return *(const int*)a - *(const int*)b;
+}
+
+static int percentile(int percent) {
+  if(s_num_latencies == 0) {
+    return 0;
+  }
+
+  int index = (s_num_latencies * percent + 99) / 100 - 1;
+  return s_latencies[index < 0 ? 0 : index];
+}
+
+static void print_header(void) {
+  printf("%-15s %8s %8s %8s %8s %7s %7s %8s %8s %10s %7s %7s %9s\n", "workload", "requests", "failed", "req/s",
+    "p50 ms", "p99 ms", "msgs", "wakeups", "bytes", "heap peak", "timers", "writes", "cpu us/req");
+}
+
+static void run_workload(const Workload *workload, uint32_t seed, bool verbose) {
+  sim_reset(&workload->link, seed);
+  sim_set_verbose(verbose);
+
+  dash_api_init("bench", error_callback);
+  dash_api_set_packed_format(workload->options & PACKED);
+  if(workload->options & PERSIST) {
+    dash_api_persist_values(PERSIST_KEY);
+  }
+  events_app_message_open();
+
+  clock_t cpu_start = clock();
+  for(int round = 0; round < workload->rounds; round++) {
+    workload->start_round();
+    if(workload->options & MINUTES) {
+      sim_run_for(60 * 1000);
+    } else if(!sim_run_until_idle(sim_now_ms() + ROUND_LIMIT_MS)) {
+      fprintf(stderr, "bench: %s round %d did not finish\n", workload->name, round);
+      exit(1);
+    }
+  }
+  double cpu_us = (double)(clock() - cpu_start) * 1000000.0 / CLOCKS_PER_SEC;
+
+  qsort(s_latencies, s_num_latencies, sizeof(int), compare_ints);
+  const SimStats *stats = sim_get_stats();
+  DashAPIStats api_stats;
+  dash_api_get_stats(&api_stats);
+  double elapsed_s = sim_now_ms() / 1000.0;
+  printf("%-15s %8d %8d %8.1f %8d %7d %7d %8d %8d %10zu %7d %7d %9.2f\n", workload->name, s_num_samples,
+    s_num_samples - s_num_latencies, elapsed_s > 0 ? s_num_latencies / elapsed_s : 0.0, percentile(50),
+    percentile(99), stats->watch_messages + stats->phone_messages, stats->radio_wakeups,
+    api_stats.outbox_bytes + api_stats.inbox_bytes,
+    stats->heap_peak, stats->timers_peak, stats->persist_writes, s_num_samples ? cpu_us / s_num_samples : 0.0);
+  fflush(stdout);
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: bench [-v] [-s seed] [workload...]\n\nWorkloads:\n");
+  for(int i = 0; i < NUM_WORKLOADS; i++) {
+    fprintf(stderr, "  %-15s %s\n", s_workloads[i].name, s_workloads[i].description);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t seed = 1;
+  bool verbose = false;
+  int option;
+  while((option = getopt(argc, argv, "vs:h")) != -1) {
+    switch(option) {
+      case 'v': verbose = true; break;
+      case 's': seed = strtoul(optarg, NULL, 10); break;
+      default:
+        usage();
+        return option == 'h' ? 0 : 1;
+    }
+  }
+
+  print_header();
+  bool failed = false;
+  for(int i = 0; i < NUM_WORKLOADS; i++) {
+    const Workload *workload = &s_workloads[i];
+    bool selected = optind == argc;
+    for(int arg = optind; arg < argc; arg++) {
+      selected |= strcmp(argv[arg], workload->name) == 0;
+    }
+    if(!selected) {
+      continue;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) {
+      run_workload(workload, seed, verbose);
+      exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,292 @@
+#include "sim.h"
+
+#include <pebble-dash-api.h>
+#include <dash-config.h>
+#include <dash-packed.h>
+
+// Scripted stand-in for android/.../dash/Service.java, answering each request as the Android app would
+
+#define RESPONSE_SIZE 512
+#define MAX_SESSION   0x7FFF
+
+// As in android/.../dash/Keys.java
+enum {
+  RequestTypeGetData = 24784,
+  RequestTypeSetFeature = 24785,
+  RequestTypeGetFeature = 24786,
+  RequestTypeError = 24787,
+  RequestTypeIsAvailable = 24788,
+  RequestTypeSubscribe = 24789,
+  RequestTypeUnsubscribe = 24790
+};
+
+enum {
+  AppKeyFeatureType = 47836,
+  AppKeyFeatureState = 47837,
+  AppKeyDataType = 47838,
+  AppKeyDataValue = 47839,
+  AppKeyUsesDashAPI = 47840,
+  AppKeyAppName = 47841,
+  AppKeyErrorCode = 47842,
+  AppKeyLibraryVersion = 47843,
+  AppKeyMinInterval = 47844,
+  AppKeyPush = 47845,
+  AppKeySession = 47846,
+  AppKeyRequestId = 47847,
+  AppKeyPacked = 47848,
+  AppKeyValueHash = 47849,
+  AppKeyNotModified = 47850
+};
+
+static int s_session;   // Issued at the last handshake, or 0 if there has been none
+static int s_feature_states[FeatureTypeAutoBrightness - FeatureTypeWifi + 1];
+static uint8_t s_response[RESPONSE_SIZE];
+#if DASH_API_PACKED
+static uint8_t s_unpacked[RESPONSE_SIZE];
+static uint8_t s_packed[RESPONSE_SIZE];
+static bool s_reply_packed;   // Whether the request being answered was packed
+#endif
+static bool s_longest_strings;
+static int s_provider_ms;
+static int s_lookup_ms;   // Added to the time to answer the request being handled
+
+void phone_reset(void) {
+  s_session = 0;
+  s_longest_strings = false;
+  s_provider_ms = 0;
+  for(int i = 0; i < FeatureTypeAutoBrightness - FeatureTypeWifi + 1; i++) {
+    s_feature_states[i] = FeatureStateOn;
+  }
+}
+
+void phone_forget_sessions(void) {
+  s_session = 0;
+}
+
+void phone_set_longest_strings(bool longest) {
+  s_longest_strings = longest;
+}
+
+// Longest string the Android app sends for a DataType, as limited by APIHandler.addString(), or 0 for integers
+static int longest_string(int type) {
+  switch(type) {
+    case DataTypeWifiNetworkName:          return 32;
+    case DataTypeStorageFreeGBString:      return 15;
+    case DataTypeGSMOperatorName:
+    case DataTypeNextCalendarEventOneLine:
+    case DataTypeNextCalendarEventTwoLine: return 63;
+    default:                               return 0;
+  }
+}
+
+void phone_set_provider_ms(int provider_ms) {
+  s_provider_ms = provider_ms;
+}
+
+static void add_data_value(DictionaryIterator *out, int type, int value_key) {
+  if(type == DataTypeUnreadSMSCount || type == DataTypeNextCalendarEventOneLine
+      || type == DataTypeNextCalendarEventTwoLine) {
+    s_lookup_ms = s_provider_ms;
+  }
+
+  int length = s_longest_strings ? longest_string(type) : 0;
+  if(length > 0) {
+    char string[64];
+    memset(string, 'x', length);
+    string[length] = '\0';
+    dict_write_cstring(out, value_key, string);
+    return;
+  }
+
+  switch(type) {
+    case DataTypeBatteryPercent:           dict_write_int32(out, value_key, 87); break;
+    case DataTypeGSMOperatorName:          dict_write_cstring(out, value_key, "Carrier"); break;
+    case DataTypeGSMStrength:              dict_write_int32(out, value_key, 75); break;
+    case DataTypeWifiNetworkName:          dict_write_cstring(out, value_key, "HomeNetwork"); break;
+    case DataTypeStoragePercentUsed:       dict_write_int32(out, value_key, 42); break;
+    case DataTypeStorageFreeGBString:      dict_write_cstring(out, value_key, "12.3 GB"); break;
+    case DataTypeUnreadSMSCount:           dict_write_int32(out, value_key, 3); break;
+    case DataTypeNextCalendarEventOneLine: dict_write_cstring(out, value_key, "14:00 Design Review"); break;
+    case DataTypeNextCalendarEventTwoLine: dict_write_cstring(out, value_key, "24 Jul 14:00\nDesign Review"); break;
+  }
+}
+
+// As APIHandler.hashValue()
+static int32_t hash_value(const char *string) {
+  uint32_t hash = 2166136261u;
+  while(*string) {
+    hash ^= (uint8_t)*string++;
+    hash *= 16777619u;
+  }
+  return hash ? (int32_t)hash : 1;
+}
+
+// As APIHandler.addDataValueIfModified(), returning the bit for AppKeyNotModified if the value matches hash
+static int add_data_value_if_modified(DictionaryIterator *out, int type, int value_key, int32_t hash) {
+  if(hash == 0) {
+    add_data_value(out, type, value_key);
+    return 0;
+  }
+
+  uint8_t buffer[RESPONSE_SIZE];
+  DictionaryIterator value;
+  dict_write_begin(&value, buffer, sizeof(buffer));
+  add_data_value(&value, type, value_key);
+  dict_write_end(&value);
+  Tuple *tuple = dict_find(&value, value_key);
+  if(tuple && tuple->type == TUPLE_CSTRING && hash_value(tuple->value->cstring) == hash) {
+    return 1 << (type - DataTypeBatteryPercent);
+  }
+
+  add_data_value(out, type, value_key);
+  return 0;
+}
+
+static void respond(DictionaryIterator *out) {
+  uint32_t length = dict_write_end(out);
+#if DASH_API_PACKED
+  if(!s_reply_packed) {
+    sim_phone_send(s_response, length, s_lookup_ms);
+    return;
+  }
+
+  // Repack the response, as Packed.pack() does
+  DashPackedWriter writer;
+  dash_packed_begin(&writer, s_packed, sizeof(s_packed));
+  DictionaryIterator iter;
+  for(Tuple *tuple = dict_read_begin_from_buffer(&iter, s_response, length); tuple; tuple = dict_read_next(&iter)) {
+    if(tuple->type == TUPLE_CSTRING) {
+      dash_packed_put_string(&writer, tuple->key, tuple->value->cstring);
+    } else {
+      dash_packed_put_integer(&writer, tuple->key, tuple->value->int32);
+    }
+  }
+
+  DictionaryIterator packed;
+  dict_write_begin(&packed, s_response, sizeof(s_response));
+  dict_write_data(&packed, AppKeyPacked, s_packed, writer.length);
+  sim_phone_send(s_response, dict_write_end(&packed), s_lookup_ms);
+#else
+  sim_phone_send(s_response, length, s_lookup_ms);
+#endif
+}
+
+void phone_push(int type) {
+  DictionaryIterator out;
+  dict_write_begin(&out, s_response, sizeof(s_response));
+  dict_write_int32(&out, AppKeyPush, 0);
+  dict_write_int32(&out, RequestTypeGetData, 0);
+  dict_write_int32(&out, AppKeyDataType, type);
+  add_data_value(&out, type, AppKeyDataValue);
+  sim_phone_send(s_response, dict_write_end(&out), 0);
+}
+
+void phone_receive(DictionaryIterator *dict) {
+#if DASH_API_PACKED
+  DictionaryIterator unpacked;
+  Tuple *packed = dict_find(dict, AppKeyPacked);
+  s_reply_packed = packed != NULL;
+  if(packed) {
+    if(!dash_packed_unpack(packed->value->data, packed->length, &unpacked, s_unpacked, sizeof(s_unpacked))) {
+      return;
+    }
+    dict = &unpacked;
+  }
+#endif
+
+  if(!dict_find(dict, AppKeyUsesDashAPI)) {
+    return;
+  }
+
+  s_lookup_ms = 0;
+  DictionaryIterator out;
+  dict_write_begin(&out, s_response, sizeof(s_response));
+
+  Tuple *request_id = dict_find(dict, AppKeyRequestId);
+  if(request_id) {
+    dict_write_int32(&out, AppKeyRequestId, request_id->value->int32);
+  }
+
+  // Handshake, or the session it started. Requests sent together at startup each handshake, so a live session
+  // is kept rather than replaced under those still in flight.
+  if(dict_find(dict, AppKeyLibraryVersion)) {
+    if(!s_session) {
+      s_session = 1 + sim_random(MAX_SESSION - 1);
+    }
+    dict_write_int32(&out, AppKeySession, s_session);
+  } else {
+    Tuple *session = dict_find(dict, AppKeySession);
+    if(!session || !s_session || session->value->int32 != s_session) {
+      dict_write_int32(&out, AppKeySession, 0);
+      respond(&out);
+      return;
+    }
+  }
+  dict_write_int32(&out, RequestTypeError, 0);
+  dict_write_int32(&out, AppKeyErrorCode, ErrorCodeSuccess);
+
+  if(dict_find(dict, RequestTypeGetData)) {
+    dict_write_int32(&out, RequestTypeGetData, 0);
+
+    int not_modified = 0;
+    Tuple *type = dict_find(dict, AppKeyDataType);
+    if(type) {
+      dict_write_int32(&out, AppKeyDataType, type->value->int32);
+      Tuple *hash = dict_find(dict, AppKeyValueHash);
+      not_modified |= add_data_value_if_modified(&out, type->value->int32, AppKeyDataValue,
+                                                 hash ? hash->value->int32 : 0);
+    } else {
+      for(int batch_type = DataTypeBatteryPercent; batch_type <= DataTypeNextCalendarEventTwoLine; batch_type++) {
+        Tuple *hash = dict_find(dict, batch_type);
+        if(hash) {
+          not_modified |= add_data_value_if_modified(&out, batch_type, batch_type, hash->value->int32);
+        }
+      }
+    }
+    if(not_modified) {
+      dict_write_int32(&out, AppKeyNotModified, not_modified);
+    }
+  }
+
+  if(dict_find(dict, RequestTypeSetFeature)) {
+    dict_write_int32(&out, RequestTypeSetFeature, 0);
+
+    Tuple *type_tuple = dict_find(dict, AppKeyFeatureType);
+    if(type_tuple) {
+      int type = type_tuple->value->int32;
+      int state = dict_find(dict, AppKeyFeatureState)->value->int32;
+      s_feature_states[type - FeatureTypeWifi] = state;
+      dict_write_int32(&out, AppKeyFeatureType, type);
+      dict_write_int32(&out, AppKeyFeatureState, state);
+    } else {
+      for(int type = FeatureTypeWifi; type <= FeatureTypeAutoBrightness; type++) {
+        Tuple *state = dict_find(dict, type);
+        if(state) {
+          s_feature_states[type - FeatureTypeWifi] = state->value->int32;
+          dict_write_int32(&out, type, state->value->int32);
+        }
+      }
+    }
+  }
+
+  if(dict_find(dict, RequestTypeGetFeature)) {
+    int type = dict_find(dict, AppKeyFeatureType)->value->int32;
+    dict_write_int32(&out, RequestTypeGetFeature, 0);
+    dict_write_int32(&out, AppKeyFeatureType, type);
+    dict_write_int32(&out, AppKeyFeatureState, s_feature_states[type - FeatureTypeWifi]);
+  }
+
+  if(dict_find(dict, RequestTypeSubscribe)) {
+    int type = dict_find(dict, AppKeyDataType)->value->int32;
+    dict_write_int32(&out, RequestTypeGetData, 0);
+    dict_write_int32(&out, AppKeyDataType, type);
+    add_data_value(&out, type, AppKeyDataValue);
+  }
+
+  if(dict_find(dict, RequestTypeUnsubscribe)) {
+    dict_write_int32(&out, RequestTypeUnsubscribe, 0);
+    dict_write_int32(&out, AppKeyDataType, dict_find(dict, AppKeyDataType)->value->int32);
+  }
+
+  respond(&out);
+}
@@ -0,0 +1,804 @@
+#define SIM_INTERNAL
+#include "sim.h"
+
+#include <pebble-events/pebble-events.h>
+#include <pebble-packet/pebble-packet.h>
+
+#include <stdarg.h>
+
+#define MAX_HANDLERS     4
+#define MAX_MESSAGE_SIZE 1024
+#define MAX_PERSIST_KEYS 32
+#define RADIO_IDLE_MS    1000   // A message after this long without any is counted as waking the radio
+#define DEFAULT_BUFFER_SIZE 64
+
+typedef enum {
+  EventKindTimer = 0,
+  EventKindDeliverToPhone,
+  EventKindDeliverToWatch,
+  EventKindOutboxSent,
+  EventKindOutboxFailed,
+  EventKindTick
+} EventKind;
+
+// Anything scheduled on the simulated clock. AppTimers are events allocated from the watch heap.
+struct AppTimer {
+  uint32_t at_ms;
+  uint32_t sequence;         // Events due at the same time happen in the order they were scheduled
+  EventKind kind;
+  AppTimerCallback callback; // EventKindTimer only
+  void *data;
+  AppMessageResult reason;   // EventKindOutboxFailed only
+  uint16_t length;           // Message events only
+  uint8_t *message;
+  struct AppTimer *next;
+};
+typedef struct AppTimer Event;
+
+// Header of each heap allocation, so that frees can be accounted
+typedef union {
+  size_t size;
+  long double align;
+} HeapHeader;
+
+// A value in the app's persistent storage
+typedef struct {
+  bool used;
+  uint32_t key;
+  size_t size;
+  uint8_t data[PERSIST_DATA_MAX_LENGTH];
+} PersistEntry;
+
+typedef enum {
+  OutboxStateIdle = 0,
+  OutboxStateWriting,  // Between app_message_outbox_begin() and app_message_outbox_send()
+  OutboxStateSending   // Awaiting an ACK or NACK
+} OutboxState;
+
+static SimLinkConfig s_config;
+static SimStats s_stats;
+static uint32_t s_now_ms, s_next_sequence, s_random_state;
+static Event *s_events;
+static int s_timers;
+static bool s_verbose, s_connected, s_open;
+
+static AppMessageInboxReceived s_inbox_handlers[MAX_HANDLERS];
+static AppMessageOutboxSent s_sent_handlers[MAX_HANDLERS];
+static AppMessageOutboxFailed s_failed_handlers[MAX_HANDLERS];
+static ConnectionHandler s_connection_handlers[MAX_HANDLERS];
+static TickHandler s_tick_handlers[MAX_HANDLERS];
+static Event *s_tick_event;   // Next minute tick, while there are tick handlers
+static uint32_t s_last_message_ms;
+static uint32_t s_inbox_size, s_outbox_size;
+
+static OutboxState s_outbox_state;
+static uint8_t s_outbox_buffer[MAX_MESSAGE_SIZE];
+static DictionaryIterator s_outbox_iter;
+
+static PacketFailedCallback *s_packet_failed_callback;
+static bool s_packet_open;
+
+static PersistEntry s_persist[MAX_PERSIST_KEYS];
+
+/********************************* Control ************************************/
+
+void sim_reset(const SimLinkConfig *config, uint32_t seed) {
+  while(s_events) {
+    Event *event = s_events;
+    s_events = event->next;
+    if(event->kind == EventKindTimer) {
+      sim_free(event);
+    } else {
+      free(event->message);
+      free(event);
+    }
+  }
+
+  s_config = *config;
+  memset(&s_stats, 0, sizeof(s_stats));
+  s_now_ms = 0;
+  s_next_sequence = 0;
+  s_random_state = seed ? seed : 1;
+  srand(s_random_state);   // For the library's retry jitter
+  s_timers = 0;
+  s_connected = true;
+  s_open = false;
+  memset(s_inbox_handlers, 0, sizeof(s_inbox_handlers));
+  memset(s_sent_handlers, 0, sizeof(s_sent_handlers));
+  memset(s_failed_handlers, 0, sizeof(s_failed_handlers));
+  memset(s_connection_handlers, 0, sizeof(s_connection_handlers));
+  memset(s_tick_handlers, 0, sizeof(s_tick_handlers));
+  s_tick_event = NULL;
+  s_last_message_ms = 0;
+  s_inbox_size = 0;
+  s_outbox_size = 0;
+  s_outbox_state = OutboxStateIdle;
+  s_packet_failed_callback = NULL;
+  s_packet_open = false;
+  memset(s_persist, 0, sizeof(s_persist));
+  phone_reset();
+}
+
+void sim_set_verbose(bool verbose) {
+  s_verbose = verbose;
+}
+
+uint32_t sim_now_ms(void) {
+  return s_now_ms;
+}
+
+int sim_random(int max) {
+  if(max <= 0) {
+    return 0;
+  }
+
+  // xorshift32
+  s_random_state ^= s_random_state << 13;
+  s_random_state ^= s_random_state >> 17;
+  s_random_state ^= s_random_state << 5;
+  return s_random_state % (max + 1);
+}
+
+const SimStats* sim_get_stats(void) {
+  return &s_stats;
+}
+
+/*********************************** Heap *************************************/
+
+static void* heap_alloc(size_t size) {
+  HeapHeader *header = malloc(sizeof(HeapHeader) + size);
+  if(!header) {
+    return NULL;
+  }
+
+  header->size = size;
+  s_stats.heap_in_use += size;
+  if(s_stats.heap_in_use > s_stats.heap_peak) {
+    s_stats.heap_peak = s_stats.heap_in_use;
+  }
+  return header + 1;
+}
+
+void* sim_malloc(size_t size) {
+  s_stats.allocations++;
+  return heap_alloc(size);
+}
+
+void* sim_calloc(size_t count, size_t size) {
+  s_stats.allocations++;
+  void *ptr = heap_alloc(count * size);
+  if(ptr) {
+    memset(ptr, 0, count * size);
+  }
+  return ptr;
+}
+
+void sim_free(void *ptr) {
+  if(!ptr) {
+    return;
+  }
+
+  HeapHeader *header = (HeapHeader*)ptr - 1;
+  s_stats.heap_in_use -= header->size;
+  free(header);
+}
+
+void* sim_realloc(void *ptr, size_t size) {
+  s_stats.allocations++;
+  if(!ptr) {
+    return heap_alloc(size);
+  }
+
+  void *moved = heap_alloc(size);
+  if(moved) {
+    size_t old_size = ((HeapHeader*)ptr - 1)->size;
+    memcpy(moved, ptr, old_size < size ? old_size : size);
+    sim_free(ptr);
+  }
+  return moved;
+}
+
+/********************************** Events ************************************/
+
+static void schedule(Event *event, uint32_t delay_ms) {
+  event->at_ms = s_now_ms + delay_ms;
+  event->sequence = s_next_sequence++;
+
+  Event **cursor = &s_events;
+  while(*cursor && (int32_t)((*cursor)->at_ms - event->at_ms) <= 0) {
+    cursor = &(*cursor)->next;
+  }
+  event->next = *cursor;
+  *cursor = event;
+}
+
+static bool unschedule(Event *event) {
+  for(Event **cursor = &s_events; *cursor; cursor = &(*cursor)->next) {
+    if(*cursor == event) {
+      *cursor = event->next;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Link events are not allocated from the watch heap
+static Event* link_event(EventKind kind, const uint8_t *message, uint16_t length) {
+  Event *event = calloc(1, sizeof(Event));
+  event->kind = kind;
+  if(message) {
+    event->message = malloc(length);
+    memcpy(event->message, message, length);
+    event->length = length;
+  }
+  return event;
+}
+
+// Count a message sent or received, and whether the radio had gone idle before it
+static void link_activity() {
+  if(s_stats.radio_wakeups == 0 || s_now_ms - s_last_message_ms > RADIO_IDLE_MS) {
+    s_stats.radio_wakeups++;
+  }
+  s_last_message_ms = s_now_ms;
+}
+
+static int link_latency() {
+  return s_config.latency_ms + sim_random(s_config.jitter_ms);
+}
+
+static bool link_lost() {
+  return sim_random(99) < s_config.loss_percent;
+}
+
+/********************************** Timers ************************************/
+
+AppTimer* app_timer_register(uint32_t timeout_ms, AppTimerCallback callback, void *callback_data) {
+  AppTimer *timer = heap_alloc(sizeof(AppTimer));   // Held by the firmware, so not a library allocation
+  if(!timer) {
+    return NULL;
+  }
+
+  memset(timer, 0, sizeof(AppTimer));
+  timer->kind = EventKindTimer;
+  timer->callback = callback;
+  timer->data = callback_data;
+  schedule(timer, timeout_ms);
+
+  s_timers++;
+  if(s_timers > s_stats.timers_peak) {
+    s_stats.timers_peak = s_timers;
+  }
+  return timer;
+}
+
+bool app_timer_reschedule(AppTimer *timer_handle, uint32_t new_timeout_ms) {
+  if(!timer_handle || !unschedule(timer_handle)) {
+    return false;
+  }
+
+  schedule(timer_handle, new_timeout_ms);
+  return true;
+}
+
+void app_timer_cancel(AppTimer *timer_handle) {
+  if(timer_handle && unschedule(timer_handle)) {
+    s_timers--;
+    sim_free(timer_handle);
+  }
+}
+
+time_t sim_time(time_t *tloc) {
+  time_t seconds = s_now_ms / 1000;
+  if(tloc) {
+    *tloc = seconds;
+  }
+  return seconds;
+}
+
+uint16_t time_ms(time_t *tloc, uint16_t *out_ms) {
+  uint16_t ms = s_now_ms % 1000;
+  sim_time(tloc);
+  if(out_ms) {
+    *out_ms = ms;
+  }
+  return ms;
+}
+
+/********************************* Logging ************************************/
+
+void app_log(uint8_t log_level, const char *src_filename, int src_line_number, const char *fmt, ...) {
+  if(log_level == APP_LOG_LEVEL_ERROR) {
+    s_stats.errors_logged++;
+  }
+  if(!s_verbose) {
+    return;
+  }
+
+  const char *name = strrchr(src_filename, '/');
+  printf("[%7u ms] %s:%d: ", s_now_ms, name ? name + 1 : src_filename, src_line_number);
+  va_list args;
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+  printf("\n");
+}
+
+/******************************** Dictionary **********************************/
+
+static size_t tuple_size(const Tuple *tuple) {
+  return sizeof(Tuple) + tuple->length;
+}
+
+static DictionaryResult dict_write_tuple(DictionaryIterator *iter, uint32_t key, TupleType type, const void *data,
+                                         uint16_t length) {
+  if(!iter || !iter->dictionary || !iter->cursor) {
+    return DICT_INVALID_ARGS;
+  }
+  if((uint8_t*)iter->cursor + sizeof(Tuple) + length > (uint8_t*)iter->end) {
+    return DICT_NOT_ENOUGH_STORAGE;
+  }
+
+  Tuple *tuple = iter->cursor;
+  tuple->key = key;
+  tuple->type = type;
+  tuple->length = length;
+  memcpy(tuple->value->data, data, length);
+  iter->dictionary->count++;
+  iter->cursor = (Tuple*)((uint8_t*)tuple + tuple_size(tuple));
+  return DICT_OK;
+}
+
+DictionaryResult dict_write_begin(DictionaryIterator *iter, uint8_t * const buffer, const uint16_t size) {
+  if(!iter || !buffer || size < sizeof(Dictionary)) {
+    return DICT_INVALID_ARGS;
+  }
+
+  iter->dictionary = (Dictionary*)buffer;
+  iter->dictionary->count = 0;
+  iter->cursor = iter->dictionary->head;
+  iter->end = buffer + size;
+  return DICT_OK;
+}
+
+DictionaryResult dict_write_int32(DictionaryIterator *iter, const uint32_t key, const int32_t value) {
+  return dict_write_tuple(iter, key, TUPLE_INT, &value, sizeof(value));
+}
+
+DictionaryResult dict_write_data(DictionaryIterator *iter, const uint32_t key, const uint8_t * const data,
+                                 const uint16_t size) {
+  if(!data) {
+    return DICT_INVALID_ARGS;
+  }
+  return dict_write_tuple(iter, key, TUPLE_BYTE_ARRAY, data, size);
+}
+
+DictionaryResult dict_write_cstring(DictionaryIterator *iter, const uint32_t key, const char * const cstring) {
+  if(!cstring) {
+    return DICT_INVALID_ARGS;
+  }
+  return dict_write_tuple(iter, key, TUPLE_CSTRING, cstring, strlen(cstring) + 1);
+}
+
+uint32_t dict_write_end(DictionaryIterator *iter) {
+  if(!iter || !iter->dictionary || !iter->cursor) {
+    return 0;
+  }
+
+  iter->end = iter->cursor;
+  return (uint8_t*)iter->cursor - (uint8_t*)iter->dictionary;
+}
+
+uint32_t dict_size(DictionaryIterator *iter) {
+  return (uint8_t*)iter->end - (uint8_t*)iter->dictionary;
+}
+
+Tuple* dict_read_begin_from_buffer(DictionaryIterator *iter, const uint8_t * const buffer, const uint16_t size) {
+  if(!iter || !buffer || size < sizeof(Dictionary)) {
+    return NULL;
+  }
+
+  iter->dictionary = (Dictionary*)buffer;
+  iter->end = buffer + size;
+  iter->cursor = iter->dictionary->head;
+  return iter->dictionary->count ? iter->cursor : NULL;
+}
+
+Tuple* dict_read_next(DictionaryIterator *iter) {
+  if((uint8_t*)iter->cursor + sizeof(Tuple) > (uint8_t*)iter->end) {
+    return NULL;
+  }
+
+  Tuple *next = (Tuple*)((uint8_t*)iter->cursor + tuple_size(iter->cursor));
+  if((uint8_t*)next + sizeof(Tuple) > (uint8_t*)iter->end) {
+    return NULL;
+  }
+  iter->cursor = next;
+  return next;
+}
+
+Tuple* dict_find(const DictionaryIterator *iter, const uint32_t key) {
+  Tuple *tuple = iter->dictionary->head;
+  for(int i = 0; i < iter->dictionary->count; i++) {
+    if(tuple->key == key) {
+      return tuple;
+    }
+    tuple = (Tuple*)((uint8_t*)tuple + tuple_size(tuple));
+  }
+  return NULL;
+}
+
+/********************************* Storage ************************************/
+
+static PersistEntry* persist_find(uint32_t key) {
+  for(int i = 0; i < MAX_PERSIST_KEYS; i++) {
+    if(s_persist[i].used && s_persist[i].key == key) {
+      return &s_persist[i];
+    }
+  }
+  return NULL;
+}
+
+bool persist_exists(const uint32_t key) {
+  return persist_find(key) != NULL;
+}
+
+int persist_read_data(const uint32_t key, void *buffer, const size_t buffer_size) {
+  PersistEntry *entry = persist_find(key);
+  if(!entry) {
+    return E_DOES_NOT_EXIST;
+  }
+
+  size_t size = entry->size < buffer_size ? entry->size : buffer_size;
+  memcpy(buffer, entry->data, size);
+  return size;
+}
+
+int persist_write_data(const uint32_t key, const void *data, const size_t size) {
+  PersistEntry *entry = persist_find(key);
+  for(int i = 0; !entry && i < MAX_PERSIST_KEYS; i++) {
+    if(!s_persist[i].used) {
+      entry = &s_persist[i];
+    }
+  }
+  if(!entry) {
+    return E_OUT_OF_STORAGE;
+  }
+
+  size_t written = size < PERSIST_DATA_MAX_LENGTH ? size : PERSIST_DATA_MAX_LENGTH;
+  entry->used = true;
+  entry->key = key;
+  entry->size = written;
+  memcpy(entry->data, data, written);
+  s_stats.persist_writes++;
+  return written;
+}
+
+int persist_delete(const uint32_t key) {
+  PersistEntry *entry = persist_find(key);
+  if(!entry) {
+    return E_DOES_NOT_EXIST;
+  }
+
+  entry->used = false;
+  return S_TRUE;
+}
+
+/******************************** AppMessage **********************************/
+
+EventHandle events_app_message_register_inbox_received(AppMessageInboxReceived received_callback, void *context) {
+  for(int i = 0; i < MAX_HANDLERS; i++) {
+    if(!s_inbox_handlers[i]) {
+      s_inbox_handlers[i] = received_callback;
+      return &s_inbox_handlers[i];
+    }
+  }
+  return NULL;
+}
+
+EventHandle events_app_message_register_outbox_sent(AppMessageOutboxSent sent_callback, void *context) {
+  for(int i = 0; i < MAX_HANDLERS; i++) {
+    if(!s_sent_handlers[i]) {
+      s_sent_handlers[i] = sent_callback;
+      return &s_sent_handlers[i];
+    }
+  }
+  return NULL;
+}
+
+EventHandle events_app_message_register_outbox_failed(AppMessageOutboxFailed failed_callback, void *context) {
+  for(int i = 0; i < MAX_HANDLERS; i++) {
+    if(!s_failed_handlers[i]) {
+      s_failed_handlers[i] = failed_callback;
+      return &s_failed_handlers[i];
+    }
+  }
+  return NULL;
+}
+
+void events_app_message_request_inbox_size(uint32_t size) {
+  if(size > s_inbox_size) {
+    s_inbox_size = size;
+  }
+}
+
+void events_app_message_request_outbox_size(uint32_t size) {
+  if(size > s_outbox_size) {
+    s_outbox_size = size;
+  }
+}
+
+AppMessageResult events_app_message_open(void) {
+  if(!s_inbox_size) {
+    s_inbox_size = DEFAULT_BUFFER_SIZE;
+  }
+  if(!s_outbox_size) {
+    s_outbox_size = DEFAULT_BUFFER_SIZE;
+  }
+  if(s_inbox_size > MAX_MESSAGE_SIZE || s_outbox_size > MAX_MESSAGE_SIZE) {
+    return APP_MSG_BUFFER_OVERFLOW;
+  }
+
+  s_open = true;
+  return APP_MSG_OK;
+}
+
+AppMessageResult app_message_outbox_begin(DictionaryIterator **iterator) {
+  if(!s_open) {
+    return APP_MSG_CLOSED;
+  }
+  if(s_outbox_state != OutboxStateIdle) {
+    return APP_MSG_BUSY;
+  }
+
+  dict_write_begin(&s_outbox_iter, s_outbox_buffer, s_outbox_size);
+  *iterator = &s_outbox_iter;
+  s_outbox_state = OutboxStateWriting;
+  return APP_MSG_OK;
+}
+
+AppMessageResult app_message_outbox_send(void) {
+  if(s_outbox_state != OutboxStateWriting) {
+    return APP_MSG_BUSY;
+  }
+  if(!s_connected) {
+    s_outbox_state = OutboxStateIdle;
+    return APP_MSG_NOT_CONNECTED;
+  }
+
+  uint16_t length = dict_write_end(&s_outbox_iter);
+  s_outbox_state = OutboxStateSending;
+  s_stats.watch_messages++;
+  link_activity();
+
+  if(link_lost()) {
+    s_stats.lost++;
+    Event *failed = link_event(EventKindOutboxFailed, NULL, 0);
+    failed->reason = APP_MSG_SEND_TIMEOUT;
+    schedule(failed, s_config.ack_timeout_ms);
+    return APP_MSG_OK;
+  }
+
+  int latency = link_latency();
+  if(sim_random(99) < s_config.busy_percent) {
+    s_stats.nacked++;
+    Event *failed = link_event(EventKindOutboxFailed, NULL, 0);
+    failed->reason = APP_MSG_SEND_REJECTED;
+    schedule(failed, latency + link_latency());
+    return APP_MSG_OK;
+  }
+
+  schedule(link_event(EventKindDeliverToPhone, s_outbox_buffer, length), latency);
+  schedule(link_event(EventKindOutboxSent, NULL, 0), latency + link_latency());
+  return APP_MSG_OK;
+}
+
+void sim_phone_send(const uint8_t *buffer, uint16_t length, int lookup_ms) {
+  s_stats.phone_messages++;
+  if(!s_connected || link_lost()) {
+    s_stats.lost++;
+    return;
+  }
+
+  int phone_ms = s_config.phone_ms + sim_random(s_config.phone_jitter_ms) + lookup_ms;
+  schedule(link_event(EventKindDeliverToWatch, buffer, length), phone_ms + link_latency());
+}
+
+static void deliver_to_watch(Event *event) {
+  link_activity();
+  if(!s_open || event->length > s_inbox_size) {
+    // The phone is told the watch could not receive it, and does not retry
+    s_stats.overflowed++;
+    return;
+  }
+
+  DictionaryIterator iter;
+  dict_read_begin_from_buffer(&iter, event->message, event->length);
+  for(int i = 0; i < MAX_HANDLERS; i++) {
+    if(s_inbox_handlers[i]) {
+      s_inbox_handlers[i](&iter, NULL);
+    }
+  }
+}
+
+static void deliver_to_phone(Event *event) {
+  DictionaryIterator iter;
+  dict_read_begin_from_buffer(&iter, event->message, event->length);
+  phone_receive(&iter);
+}
+
+static void outbox_sent(void) {
+  s_outbox_state = OutboxStateIdle;
+  for(int i = 0; i < MAX_HANDLERS; i++) {
+    if(s_sent_handlers[i]) {
+      s_sent_handlers[i](&s_outbox_iter, NULL);
+    }
+  }
+}
+
+static void outbox_failed(AppMessageResult reason) {
+  s_outbox_state = OutboxStateIdle;
+  for(int i = 0; i < MAX_HANDLERS; i++) {
+    if(s_failed_handlers[i]) {
+      s_failed_handlers[i](&s_outbox_iter, reason, NULL);
+    }
+  }
+  if(s_packet_failed_callback) {
+    s_packet_failed_callback();
+  }
+}
+
+/******************************** Connection **********************************/
+
+EventHandle events_connection_service_subscribe(ConnectionHandlers conn_handlers) {
+  for(int i = 0; i < MAX_HANDLERS; i++) {
+    if(!s_connection_handlers[i]) {
+      s_connection_handlers[i] = conn_handlers.pebble_app_connection_handler;
+      return &s_connection_handlers[i];
+    }
+  }
+  return NULL;
+}
+
+bool connection_service_peek_pebble_app_connection(void) {
+  return s_connected;
+}
+
+void sim_set_connected(bool connected) {
+  if(connected == s_connected) {
+    return;
+  }
+
+  s_connected = connected;
+  for(int i = 0; i < MAX_HANDLERS; i++) {
+    if(s_connection_handlers[i]) {
+      s_connection_handlers[i](connected);
+    }
+  }
+}
+
+/*********************************** Tick *************************************/
+
+static void schedule_tick() {
+  s_tick_event = link_event(EventKindTick, NULL, 0);
+  schedule(s_tick_event, 60000 - s_now_ms % 60000);
+}
+
+EventHandle events_tick_timer_service_subscribe(TimeUnits tick_units, TickHandler handler) {
+  for(int i = 0; i < MAX_HANDLERS; i++) {
+    if(!s_tick_handlers[i]) {
+      s_tick_handlers[i] = handler;
+      if(!s_tick_event) {
+        schedule_tick();
+      }
+      return &s_tick_handlers[i];
+    }
+  }
+  return NULL;
+}
+
+void events_tick_timer_service_unsubscribe(EventHandle handle) {
+  *(TickHandler*)handle = NULL;
+  for(int i = 0; i < MAX_HANDLERS; i++) {
+    if(s_tick_handlers[i]) {
+      return;
+    }
+  }
+
+  if(s_tick_event && unschedule(s_tick_event)) {
+    free(s_tick_event);
+  }
+  s_tick_event = NULL;
+}
+
+// Call the tick handlers each minute, as with MINUTE_UNIT
+static void tick() {
+  s_tick_event = NULL;
+  schedule_tick();
+
+  time_t seconds = s_now_ms / 1000;
+  struct tm *tick_time = gmtime(&seconds);
+  for(int i = 0; i < MAX_HANDLERS; i++) {
+    if(s_tick_handlers[i]) {
+      s_tick_handlers[i](tick_time, MINUTE_UNIT);
+    }
+  }
+}
+
+/********************************** Packet ************************************/
+
+bool packet_begin() {
+  DictionaryIterator *iter;
+  s_packet_open = app_message_outbox_begin(&iter) == APP_MSG_OK;
+  return s_packet_open;
+}
+
+bool packet_put_integer(int key, int value) {
+  return s_packet_open && dict_write_int32(&s_outbox_iter, key, value) == DICT_OK;
+}
+
+bool packet_put_string(int key, char *string) {
+  return s_packet_open && dict_write_cstring(&s_outbox_iter, key, string) == DICT_OK;
+}
+
+bool packet_send(PacketFailedCallback *failed_callback) {
+  s_packet_open = false;
+  s_packet_failed_callback = failed_callback;
+  return app_message_outbox_send() == APP_MSG_OK;
+}
+
+/*********************************** Run **************************************/
+
+bool sim_step(void) {
+  Event *event = s_events;
+  if(!event) {
+    return false;
+  }
+
+  s_events = event->next;
+  s_now_ms = event->at_ms;
+  switch(event->kind) {
+    case EventKindTimer:
+      s_timers--;
+      event->callback(event->data);
+      sim_free(event);
+      return true;
+    case EventKindDeliverToPhone:
+      deliver_to_phone(event);
+      break;
+    case EventKindDeliverToWatch:
+      deliver_to_watch(event);
+      break;
+    case EventKindOutboxSent:
+      outbox_sent();
+      break;
+    case EventKindOutboxFailed:
+      outbox_failed(event->reason);
+      break;
+    case EventKindTick:
+      tick();
+      break;
+  }
+
+  free(event->message);
+  free(event);
+  return true;
+}
+
+bool sim_run_until_idle(uint32_t limit_ms) {
+  // The minute tick alone does not keep the simulation busy
+  while(s_events && !(s_events == s_tick_event && !s_events->next)) {
+    if((int32_t)(s_events->at_ms - limit_ms) > 0) {
+      return false;
+    }
+    sim_step();
+  }
+  return true;
+}
+
+void sim_run_for(uint32_t duration_ms) {
+  uint32_t end_ms = s_now_ms + duration_ms;
+  while(s_events && (int32_t)(s_events->at_ms - end_ms) <= 0) {
+    sim_step();
+  }
+  s_now_ms = end_ms;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <pebble.h>
+
+// Behaviour of the simulated Bluetooth link between the watch and the phone
+typedef struct {
+  int latency_ms;       // One way, for each message and each ACK
+  int jitter_ms;        // Up to this much is randomly added to each latency
+  int loss_percent;     // Chance of a message being lost in either direction
+  int busy_percent;     // Chance of the phone NACKing a watch message as busy
+  int ack_timeout_ms;   // Time before a lost watch message fails with APP_MSG_SEND_TIMEOUT
+  int phone_ms;         // Time taken by the phone to handle a request before responding
+  int phone_jitter_ms;  // Up to this much is randomly added to phone_ms
+} SimLinkConfig;
+
+// Counters for a run of the simulation
+typedef struct {
+  int watch_messages;   // Sent by the watch
+  int phone_messages;   // Sent by the phone
+  int lost;             // In either direction
+  int nacked;           // Watch messages rejected as busy
+  int overflowed;       // Phone messages too large for the watch inbox
+  int errors_logged;    // APP_LOG_LEVEL_ERROR lines from the library
+  size_t heap_in_use;
+  size_t heap_peak;     // High-water mark of library and AppTimer allocations
+  int allocations;      // Calls to malloc(), calloc() and realloc() from the library, not AppTimers
+  int timers_peak;
+  int persist_writes;   // Calls to persist_write_data()
+  int radio_wakeups;    // Messages sent or received after the link was idle for a while
+} SimStats;
+
+// Start again from time zero, with no events pending
+void sim_reset(const SimLinkConfig *config, uint32_t seed);
+
+// Print library logs with the simulated time as they happen
+void sim_set_verbose(bool verbose);
+
+uint32_t sim_now_ms(void);
+
+// Uniformly random in [0, max], reproducible for a given seed
+int sim_random(int max);
+
+// Handle the next pending event, advancing the clock. Returns false if none are pending.
+bool sim_step(void);
+
+// Handle events until none are pending or the clock would pass limit_ms. Returns false if events remain.
+bool sim_run_until_idle(uint32_t limit_ms);
+
+// Handle all events due in the next duration_ms, and advance the clock to its end
+void sim_run_for(uint32_t duration_ms);
+
+// Connect or disconnect the phone, notifying subscribed connection handlers
+void sim_set_connected(bool connected);
+
+const SimStats* sim_get_stats(void);
+
+// Deliver a message from the phone to the watch inbox, after the phone's handling time, lookup_ms more for
+// slow lookups, and the link latency
+void sim_phone_send(const uint8_t *buffer, uint16_t length, int lookup_ms);
+
+/********************************** Phone *************************************/
+
+// Scripted stand-in for the Dash API Android app, implemented by src/phone.c
+
+void phone_reset(void);
+
+// Handle a message received from the watch
+void phone_receive(DictionaryIterator *iter);
+
+// Forget all sessions, as if the Android service had been restarted
+void phone_forget_sessions(void);
+
+// Answer with strings of the greatest length the Android app sends, rather than typical ones
+void phone_set_longest_strings(bool longest);
+
+// Take this much longer to answer requests for calendar events or unread SMS, as a cold content provider query
+// does
+void phone_set_provider_ms(int provider_ms);
+
+// Push the value of a DataType, as SubscriptionManager does when it changes
+void phone_push(int type);
@@ -0,0 +1,420 @@
+#include "sim.h"
+
+#include <pebble-dash-api.h>
+#include <pebble-events/pebble-events.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Checks of the library over the simulated link. Each check runs in its own process, so that the library
+// starts from its initial state, and the run fails if any check does.
+
+#define WARM_UP_ROUNDS 5     // Enough for the handshake and for each value to be cached
+#define ROUNDS         100
+#define ROUND_LIMIT_MS 60000
+#define PERSIST_KEY    1000
+#define SCHEDULE_PERIOD_S 60
+#define SCHEDULE_RUN_MS   (5 * 60 * 1000)
+#define SLOW_PROVIDER_MS  1500
+#define APP_MESSAGE_KEY   1   // Of a message of the app's own
+#define OPEN_DELAY_MS     200 // DELAY_MS in the library, before a request when AppMessage may not be open
+
+#define LINK_GOOD { .latency_ms = 30, .jitter_ms = 10, .ack_timeout_ms = 3000, .phone_ms = 20, .phone_jitter_ms = 10 }
+
+typedef struct {
+  const char *name;
+  void (*start_round)(void);
+  bool packed;
+  bool persist;
+} Check;
+
+static int s_delivered, s_errors;
+
+static void data_callback(DataType type, DataValue value) {
+  s_delivered++;
+}
+
+// Counts only values passed the context the check expects
+static void data_context_callback(DataType type, DataValue value, void *context) {
+  if(context == &s_delivered) {
+    s_delivered++;
+  }
+}
+
+static void feature_callback(FeatureType type, FeatureState state) {
+  s_delivered++;
+}
+
+static void error_callback(ErrorCode code) {
+  s_errors++;
+}
+
+/********************************** Rounds ************************************/
+
+static const DataType s_refresh_types[] = {
+  DataTypeBatteryPercent,
+  DataTypeGSMStrength,
+  DataTypeWifiNetworkName,
+  DataTypeNextCalendarEventOneLine
+};
+#define NUM_REFRESH_TYPES (int)(sizeof(s_refresh_types) / sizeof(DataType))
+
+static void refresh_round(void) {
+  for(int i = 0; i < NUM_REFRESH_TYPES; i++) {
+    dash_api_get_data(s_refresh_types[i], data_callback);
+  }
+}
+
+static void refresh_batch_round(void) {
+  dash_api_get_data_batch(s_refresh_types, NUM_REFRESH_TYPES, data_callback);
+}
+
+static void features_round(void) {
+  dash_api_get_feature(FeatureTypeWifi, feature_callback);
+  dash_api_set_feature(FeatureTypeRinger, FeatureStateRingerVibrate, feature_callback);
+}
+
+static const Check s_checks[] = {
+  { "refresh",         refresh_round,       false, false },
+  { "refresh-packed",  refresh_round,       true,  false },
+  { "batch",           refresh_batch_round, false, false },
+  { "batch-packed",    refresh_batch_round, true,  false },
+  { "batch-persist",   refresh_batch_round, true,  true  },
+  { "features",        features_round,      false, false }
+};
+#define NUM_CHECKS (int)(sizeof(s_checks) / sizeof(Check))
+
+/********************************** Checks ************************************/
+
+static void run_rounds(const Check *check, int rounds) {
+  for(int round = 0; round < rounds; round++) {
+    check->start_round();
+    if(!sim_run_until_idle(sim_now_ms() + ROUND_LIMIT_MS)) {
+      fprintf(stderr, "test: %s round %d did not finish\n", check->name, round);
+      exit(1);
+    }
+  }
+}
+
+// Once warmed up, handling responses must not allocate
+static bool check_allocations(const Check *check) {
+  SimLinkConfig link = LINK_GOOD;
+  sim_reset(&link, 1);
+
+  dash_api_init("test", error_callback);
+  dash_api_set_packed_format(check->packed);
+  if(check->persist) {
+    dash_api_persist_values(PERSIST_KEY);
+  }
+  events_app_message_open();
+
+  run_rounds(check, WARM_UP_ROUNDS);
+  int allocations = sim_get_stats()->allocations;
+  s_delivered = 0;
+  run_rounds(check, ROUNDS);
+  allocations = sim_get_stats()->allocations - allocations;
+
+  if(s_delivered == 0 || s_errors > 0) {
+    printf("FAIL %-15s %d values delivered, %d errors\n", check->name, s_delivered, s_errors);
+    return false;
+  }
+  if(allocations != 0) {
+    printf("FAIL %-15s %d allocations over %d rounds\n", check->name, allocations, ROUNDS);
+    return false;
+  }
+  printf("ok   %-15s %d values, no allocations\n", check->name, s_delivered);
+  return true;
+}
+
+// Scheduled refreshes of every DataType are split into requests whose responses fit the inbox, even with the
+// longest strings the phone sends
+static bool check_schedule_fits_inbox(const Check *check) {
+  SimLinkConfig link = LINK_GOOD;
+  sim_reset(&link, 1);
+  phone_set_longest_strings(true);
+
+  dash_api_init("test", error_callback);
+  for(int type = DataTypeBatteryPercent; type <= DataTypeNextCalendarEventTwoLine; type++) {
+    dash_api_schedule(type, SCHEDULE_PERIOD_S, data_callback);
+  }
+  events_app_message_open();
+  sim_run_for(SCHEDULE_RUN_MS);
+
+  int overflowed = sim_get_stats()->overflowed;
+  if(overflowed > 0 || s_errors > 0 || s_delivered == 0) {
+    printf("FAIL %-15s %d responses too large for the inbox, %d errors, %d values delivered\n", "schedule-all",
+      overflowed, s_errors, s_delivered);
+    return false;
+  }
+  printf("ok   %-15s %d values, no responses too large for the inbox\n", "schedule-all", s_delivered);
+  return true;
+}
+
+// Every DataType but DataTypeNextCalendarEventTwoLine. With the longest strings the phone sends, the values only
+// fit the inbox in one response when packed.
+static const DataType s_limit_types[] = {
+  DataTypeBatteryPercent,
+  DataTypeGSMOperatorName,
+  DataTypeGSMStrength,
+  DataTypeWifiNetworkName,
+  DataTypeStoragePercentUsed,
+  DataTypeStorageFreeGBString,
+  DataTypeUnreadSMSCount,
+  DataTypeNextCalendarEventOneLine
+};
+#define NUM_LIMIT_TYPES (int)(sizeof(s_limit_types) / sizeof(DataType))
+
+static const Check s_limit_checks[] = {
+  { "batch-limit",  NULL, false, false },
+  { "limit-packed", NULL, true,  false }
+};
+
+// A batch too large for one response is split into requests whose responses fit the inbox, and a packed
+// response holds more values than a dictionary
+static bool check_batch_near_limit(const Check *check) {
+  SimLinkConfig link = LINK_GOOD;
+  sim_reset(&link, 1);
+  phone_set_longest_strings(true);
+
+  dash_api_init("test", error_callback);
+  dash_api_set_packed_format(check->packed);
+  events_app_message_open();
+  dash_api_get_data_batch(s_limit_types, NUM_LIMIT_TYPES, data_callback);
+  sim_run_until_idle(sim_now_ms() + ROUND_LIMIT_MS);
+
+  int expected = check->packed ? 1 : 2;
+  const SimStats *stats = sim_get_stats();
+  if(s_errors > 0 || s_delivered != NUM_LIMIT_TYPES || stats->overflowed > 0 || stats->watch_messages != expected) {
+    printf("FAIL %-15s %d values delivered in %d requests, %d responses too large for the inbox, %d errors\n",
+      check->name, s_delivered, stats->watch_messages, stats->overflowed, s_errors);
+    return false;
+  }
+  printf("ok   %-15s %d values in %d requests\n", check->name, s_delivered, expected);
+  return true;
+}
+
+static void quick_and_provider_round(void) {
+  dash_api_get_data(DataTypeBatteryPercent, data_callback);
+  dash_api_get_data(DataTypeGSMStrength, data_callback);
+  dash_api_get_data(DataTypeNextCalendarEventOneLine, data_callback);
+}
+
+// Once round trips are short, a calendar lookup that is slow when cold still does not time out
+static bool check_slow_provider(const Check *check) {
+  static const Check rounds = { "slow-provider", quick_and_provider_round, false, false };
+  SimLinkConfig link = LINK_GOOD;
+  sim_reset(&link, 1);
+
+  dash_api_init("test", error_callback);
+  events_app_message_open();
+  run_rounds(&rounds, WARM_UP_ROUNDS * 4);
+
+  phone_set_provider_ms(SLOW_PROVIDER_MS);
+  s_delivered = 0;
+  run_rounds(&rounds, 1);
+
+  if(s_errors > 0 || s_delivered != 3) {
+    printf("FAIL %-15s %d values delivered, %d errors\n", rounds.name, s_delivered, s_errors);
+    return false;
+  }
+  printf("ok   %-15s %d ms lookup answered in time\n", rounds.name, SLOW_PROVIDER_MS);
+  return true;
+}
+
+// Values received just before the app exits are persisted by dash_api_deinit(), rather than lost with the timer
+// that would have written them
+static bool check_deinit_persists(const Check *check) {
+  SimLinkConfig link = LINK_GOOD;
+  sim_reset(&link, 1);
+
+  dash_api_init("test", error_callback);
+  dash_api_persist_values(PERSIST_KEY);
+  events_app_message_open();
+  refresh_batch_round();
+  sim_run_for(1000);
+
+  int delivered = s_delivered;
+  int writes = sim_get_stats()->persist_writes;
+  dash_api_deinit();
+  int deinit_writes = sim_get_stats()->persist_writes - writes;
+  sim_run_for(10 * 1000);
+  int later_writes = sim_get_stats()->persist_writes - writes - deinit_writes;
+
+  if(delivered != NUM_REFRESH_TYPES || writes != 0 || deinit_writes != NUM_REFRESH_TYPES || later_writes != 0) {
+    printf("FAIL %-15s %d values delivered, %d writes before, %d by dash_api_deinit(), %d after\n", "deinit-persist",
+      delivered, writes, deinit_writes, later_writes);
+    return false;
+  }
+  printf("ok   %-15s %d values written by dash_api_deinit()\n", "deinit-persist", deinit_writes);
+  return true;
+}
+
+// Messages the app sends and receives itself over the shared AppMessage are not counted as the library's
+static bool check_stats_count_dash_only(const Check *check) {
+  SimLinkConfig link = LINK_GOOD;
+  sim_reset(&link, 1);
+
+  dash_api_init("test", error_callback);
+  events_app_message_open();
+  refresh_batch_round();
+  sim_run_until_idle(sim_now_ms() + ROUND_LIMIT_MS);
+  dash_api_reset_stats();
+
+  uint8_t buffer[32];
+  DictionaryIterator app_message;
+  dict_write_begin(&app_message, buffer, sizeof(buffer));
+  dict_write_int32(&app_message, APP_MESSAGE_KEY, 1);
+  sim_phone_send(buffer, dict_write_end(&app_message), 0);
+
+  DictionaryIterator *outbox;
+  app_message_outbox_begin(&outbox);
+  dict_write_int32(outbox, APP_MESSAGE_KEY, 1);
+  app_message_outbox_send();
+  sim_run_until_idle(sim_now_ms() + ROUND_LIMIT_MS);
+
+  DashAPIStats app_stats;
+  dash_api_get_stats(&app_stats);
+  refresh_batch_round();
+  sim_run_until_idle(sim_now_ms() + ROUND_LIMIT_MS);
+  DashAPIStats dash_stats;
+  dash_api_get_stats(&dash_stats);
+
+  if(app_stats.inbox_bytes != 0 || app_stats.outbox_bytes != 0 || dash_stats.inbox_bytes == 0
+      || dash_stats.outbox_bytes == 0) {
+    printf("FAIL %-15s %d inbox and %d outbox bytes counted for app messages, %d and %d for a request\n",
+      "stats-bytes", app_stats.inbox_bytes, app_stats.outbox_bytes, dash_stats.inbox_bytes,
+      dash_stats.outbox_bytes);
+    return false;
+  }
+  printf("ok   %-15s app messages not counted\n", "stats-bytes");
+  return true;
+}
+
+// Requests made together at startup each carry the handshake header, and every one is answered without the
+// watch having to handshake again
+static bool check_startup_burst(const Check *check) {
+  SimLinkConfig link = LINK_GOOD;
+  sim_reset(&link, 1);
+
+  dash_api_init("test", error_callback);
+  events_app_message_open();
+  refresh_round();
+  dash_api_get_data(DataTypeUnreadSMSCount, data_callback);
+  features_round();
+  sim_run_until_idle(sim_now_ms() + ROUND_LIMIT_MS);
+
+  int expected = NUM_REFRESH_TYPES + 3;
+  int sent = sim_get_stats()->watch_messages;
+  if(s_errors > 0 || s_delivered != expected || sent != expected) {
+    printf("FAIL %-15s %d messages sent for %d requests, %d values delivered, %d errors\n", "startup-burst",
+      sent, expected, s_delivered, s_errors);
+    return false;
+  }
+  printf("ok   %-15s %d requests in %d messages\n", "startup-burst", expected, sent);
+  return true;
+}
+
+// The value received on subscribing and each pushed value go to the callback given to
+// dash_api_subscribe_with_context(), with its context
+static bool check_subscribe_context(const Check *check) {
+  SimLinkConfig link = LINK_GOOD;
+  sim_reset(&link, 1);
+
+  dash_api_init("test", error_callback);
+  events_app_message_open();
+  dash_api_subscribe_with_context(DataTypeBatteryPercent, 0, data_context_callback, &s_delivered);
+  sim_run_until_idle(sim_now_ms() + ROUND_LIMIT_MS);
+  phone_push(DataTypeBatteryPercent);
+  sim_run_until_idle(sim_now_ms() + ROUND_LIMIT_MS);
+
+  if(s_errors > 0 || s_delivered != 2) {
+    printf("FAIL %-15s %d values delivered with the context, %d errors\n", "subscribe-ctx", s_delivered, s_errors);
+    return false;
+  }
+  printf("ok   %-15s %d values delivered with the context\n", "subscribe-ctx", s_delivered);
+  return true;
+}
+
+// After the phone reconnects, the first request waits for AppMessage to open again, as the first one did
+static bool check_reconnect_delay(const Check *check) {
+  SimLinkConfig link = LINK_GOOD;
+  sim_reset(&link, 1);
+
+  dash_api_init("test", error_callback);
+  events_app_message_open();
+  run_rounds(&s_checks[0], WARM_UP_ROUNDS);
+
+  sim_set_connected(false);
+  sim_run_for(1000);
+  sim_set_connected(true);
+  uint32_t start_ms = sim_now_ms();
+  dash_api_get_data(DataTypeBatteryPercent, data_callback);
+  sim_run_until_idle(start_ms + ROUND_LIMIT_MS);
+  int elapsed_ms = sim_now_ms() - start_ms;
+
+  if(s_errors > 0 || elapsed_ms < OPEN_DELAY_MS) {
+    printf("FAIL %-15s first request answered after %d ms, %d errors\n", "reconnect", elapsed_ms, s_errors);
+    return false;
+  }
+  printf("ok   %-15s first request waited %d ms for AppMessage\n", "reconnect", elapsed_ms);
+  return true;
+}
+
+// Once a DataType is unscheduled, its callback is not called for refreshes already waiting or in flight
+static bool check_unschedule(const Check *check) {
+  SimLinkConfig link = LINK_GOOD;
+  sim_reset(&link, 1);
+
+  dash_api_init("test", error_callback);
+  events_app_message_open();
+  dash_api_schedule(DataTypeBatteryPercent, SCHEDULE_PERIOD_S, data_callback);
+  dash_api_schedule(DataTypeGSMStrength, SCHEDULE_PERIOD_S, data_callback);
+
+  // The batch waits for AppMessage to open, and is then sent for the DataType left
+  sim_run_for(OPEN_DELAY_MS / 2);
+  dash_api_unschedule(DataTypeBatteryPercent);
+  sim_run_for(OPEN_DELAY_MS / 2 + link.latency_ms);
+  dash_api_unschedule(DataTypeGSMStrength);
+  sim_run_for(SCHEDULE_RUN_MS);
+
+  int sent = sim_get_stats()->watch_messages;
+  if(s_errors > 0 || s_delivered > 0 || sent != 1) {
+    printf("FAIL %-15s %d values delivered after unscheduling, %d requests sent, %d errors\n", "unschedule",
+      s_delivered, sent, s_errors);
+    return false;
+  }
+  printf("ok   %-15s no values delivered after unscheduling\n", "unschedule");
+  return true;
+}
+
+// Run a check in its own process, returning whether it passed
+static bool run_check(bool (*check)(const Check*), const Check *argument) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if(pid == 0) {
+    exit(check(argument) ? 0 : 1);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char *argv[]) {
+  bool failed = false;
+  for(int i = 0; i < NUM_CHECKS; i++) {
+    failed |= !run_check(check_allocations, &s_checks[i]);
+  }
+  failed |= !run_check(check_schedule_fits_inbox, NULL);
+  for(int i = 0; i < (int)(sizeof(s_limit_checks) / sizeof(Check)); i++) {
+    failed |= !run_check(check_batch_near_limit, &s_limit_checks[i]);
+  }
+  failed |= !run_check(check_slow_provider, NULL);
+  failed |= !run_check(check_deinit_persists, NULL);
+  failed |= !run_check(check_stats_count_dash_only, NULL);
+  failed |= !run_check(check_startup_burst, NULL);
+  failed |= !run_check(check_subscribe_context, NULL);
+  failed |= !run_check(check_reconnect_delay, NULL);
+  failed |= !run_check(check_unschedule, NULL);
+  return failed ? 1 : 0;
+}
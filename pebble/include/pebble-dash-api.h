@@ -2,7 +2,7 @@
 
 #include <pebble.h>
 
-#define ANDROID_APP_VERSION "1.2"   // The minimum compatible Android app version.
+#define ANDROID_APP_VERSION "1.8"   // The minimum compatible Android app version.
 
 /******************************** Enumerations ********************************/
 
@@ -50,13 +50,41 @@ typedef struct {
   char* string_value;
 } DataValue;
 
+#define DASH_API_RTT_BUCKETS 8   // See DashAPIStats.rtt_histogram
+
+// Counters of the library's activity since dash_api_init() or dash_api_reset_stats(), from dash_api_get_stats()
+typedef struct {
+  int get_data_sent;          // Requests sent to the phone of each kind. A batch request counts once.
+  int set_feature_sent;
+  int get_feature_sent;
+  int subscribe_sent;
+  int unsubscribe_sent;
+  int is_available_sent;
+  int responses;              // Responses that completed a request
+  int late_responses;         // Responses ignored because their request had already timed out
+  int pushes;                 // Values pushed for subscriptions
+  int timeouts;               // Requests that timed out without a response
+  int send_failures;          // Requests that could not be sent, as reported with ErrorCodeSendingFailed
+  int retries;                // Attempts to send a request again after it could not be sent
+  int queue_full;             // Requests rejected because too many were in progress, with ErrorCodeQueueFull
+  int rate_limited;           // Requests refused by the phone with ErrorCodeRateLimited
+  int outbox_bytes;           // Size of the library's messages delivered to the phone, not the app's own
+  int inbox_bytes;            // Size of the library's messages received from the phone, not the app's own
+  int cache_hits;             // As for dash_api_get_cache_stats()
+  int cache_misses;
+  int rtt_histogram[DASH_API_RTT_BUCKETS]; // Round trip times of completed requests, in buckets up to 50, 100,
+                                           // 200, 500, 1000, 2000 and 5000 ms, and longer
+} DashAPIStats;
+
 // Result codes for callbacks
 typedef enum {
   ErrorCodeSuccess = 0,            // The request was made successfully
   ErrorCodeSendingFailed,          // The sending of the request failed, or there was no connection
   ErrorCodeUnavailable,            // The request timed out or the Android app was unavailable, or not installed
   ErrorCodeNoPermissions,          // This app has not been permitted in the Dash API Android app
-  ErrorCodeWrongVersion            // An old or incompatible version of the Dash API Android app is installed
+  ErrorCodeWrongVersion,           // An old or incompatible version of the Dash API Android app is installed
+  ErrorCodeQueueFull,              // Too many requests were already waiting to be sent, so this one was dropped
+  ErrorCodeRateLimited             // This app made too many requests in a short time, so the phone refused this one
 } ErrorCode;
 
 /********************************* Callbacks **********************************/
@@ -74,6 +102,20 @@ typedef void(DashAPIFeatureCallback)(FeatureType, FeatureState);
 //   DataValue  - The data returned by the request (valid for the duration of the callback).
 typedef void(DashAPIDataCallback)(DataType, DataValue);
 
+// As for DashAPIFeatureCallback, for requests made with a context.
+// Parameters:
+//   FeatureType  - The type of feature that was originally requested.
+//   FeatureState - The state of the feature.
+//   void*        - The context given when the request was made.
+typedef void(DashAPIFeatureContextCallback)(FeatureType, FeatureState, void*);
+
+// As for DashAPIDataCallback, for requests made with a context.
+// Parameters:
+//   DataType   - The type of data that was requested.
+//   DataValue  - The data returned by the request (valid for the duration of the callback).
+//   void*      - The context given when the request was made.
+typedef void(DashAPIDataContextCallback)(DataType, DataValue, void*);
+
 // Callback called when a request fails for some reason.
 // Parameters:
 //   ErrorCode - The code representing the result of the request
@@ -82,24 +124,111 @@ typedef void(DashAPIErrorCallback)(ErrorCode);
 /************************************ API *************************************/
 
 // Get some data from the phone side of this library.
+// If a cache TTL is set for the DataType with dash_api_set_cache_ttl(), a cached value is delivered to the
+// callback before this function returns. See dash_api_set_cache_ttl() for details.
+// Several requests can be in progress at once, and their responses may arrive in any order. Requests are sent
+// in the order they were made, and if too many are in progress ErrorCodeQueueFull is delivered to the
+// DashAPIErrorCallback.
 // Parameters:
 //   type     - The type of data to get.
 //   callback - The callback called when the request succeeds or fails.
 void dash_api_get_data(DataType type, DashAPIDataCallback *callback);
 
-// Change the state of a phone feature.
+// As for dash_api_get_data(), with a context passed to the callback.
+// Parameters:
+//   type     - The type of data to get.
+//   callback - The callback called when the request succeeds.
+//   context  - Pointer passed to the callback, such as the widget that made the request.
+void dash_api_get_data_with_context(DataType type, DashAPIDataContextCallback *callback, void *context);
+
+// Get several items of data from the phone side of this library in a single request and response.
+// The callback is called once for each DataType, in the order they are declared in DataType.
+// DataTypes whose values may not all fit in the inbox, such as several calendar event DataTypes, are sent in
+// as many requests as needed.
+// Parameters:
+//   types    - Array of the types of data to get.
+//   count    - The number of DataTypes in types.
+//   callback - The callback called for each value when the request succeeds.
+void dash_api_get_data_batch(const DataType *types, int count, DashAPIDataCallback *callback);
+
+// As for dash_api_get_data_batch(), with a context passed to the callback.
+void dash_api_get_data_batch_with_context(const DataType *types, int count, DashAPIDataContextCallback *callback,
+                                          void *context);
+
+// Change the state of a phone feature. Queued as for dash_api_get_data().
 // Parameters:
 //   type      - The type of feature to change state of.
 //   new_state - The state to set this feature into.
 //   callback  - The callback called when the request succeeds or fails.
 void dash_api_set_feature(FeatureType type, FeatureState new_state, DashAPIFeatureCallback *callback);
 
-// Get the state of a feature on the phone.
+// As for dash_api_set_feature(), with a context passed to the callback.
+void dash_api_set_feature_with_context(FeatureType type, FeatureState new_state,
+                                       DashAPIFeatureContextCallback *callback, void *context);
+
+// Change the state of several phone features in one request, such as for a night mode profile. The Android app
+// sets them in the order of FeatureType, so that Wifi is changed before HotSpot, and the callback is called for
+// each feature with its new state.
+// Parameters:
+//   types     - The FeatureTypes to change the state of.
+//   states    - The state to set each feature into, in the same order as types.
+//   count     - The number of FeatureTypes in types.
+//   callback  - The callback called for each feature when the request succeeds.
+void dash_api_set_features(const FeatureType *types, const FeatureState *states, int count,
+                           DashAPIFeatureCallback *callback);
+
+// As for dash_api_set_features(), with a context passed to the callback.
+void dash_api_set_features_with_context(const FeatureType *types, const FeatureState *states, int count,
+                                        DashAPIFeatureContextCallback *callback, void *context);
+
+// Get the state of a feature on the phone. Queued as for dash_api_get_data().
 // Parameters:
 //   type     - The type of feature to get the state of.
 //   callback - The callback called when the request succeeds or fails.
 void dash_api_get_feature(FeatureType type, DashAPIFeatureCallback *callback);
 
+// As for dash_api_get_feature(), with a context passed to the callback.
+void dash_api_get_feature_with_context(FeatureType type, DashAPIFeatureContextCallback *callback, void *context);
+
+// Refresh a DataType periodically, instead of with a timer of the app's own. All scheduled refreshes that fall
+// due around the same minute tick are made together, in as few requests as have responses that fit the inbox,
+// and none are made while the phone is disconnected, those overdue being made on reconnection. The first
+// refresh is made straight away.
+// Parameters:
+//   type     - The DataType to refresh.
+//   period_s - The number of seconds between refreshes, ideally a multiple of 60.
+//   callback - The callback called with each value received.
+void dash_api_schedule(DataType type, int period_s, DashAPIDataCallback *callback);
+
+// As for dash_api_schedule(), with a context passed to the callback.
+void dash_api_schedule_with_context(DataType type, int period_s, DashAPIDataContextCallback *callback,
+                                    void *context);
+
+// Stop the periodic refreshes of a DataType made with dash_api_schedule(). Its callback is not called again,
+// even with the value of a refresh already requested.
+// Parameters:
+//   type - The DataType to stop refreshing.
+void dash_api_unschedule(DataType type);
+
+// Ask the phone to push the value of a DataType whenever it changes, instead of polling with
+// dash_api_get_data(). The callback receives the current value once the subscription is made, and then
+// each changed value, no more often than min_interval_ms. Subscriptions end when the Android app is
+// restarted or stops being able to deliver to this app, so subscribe again each time the app starts.
+// Parameters:
+//   type            - The type of data to subscribe to.
+//   min_interval_ms - The minimum time between pushed values, in milliseconds.
+//   callback        - The callback called with the current value, and then each changed value.
+void dash_api_subscribe(DataType type, int min_interval_ms, DashAPIDataCallback *callback);
+
+// As for dash_api_subscribe(), with a context passed to the callback.
+void dash_api_subscribe_with_context(DataType type, int min_interval_ms, DashAPIDataContextCallback *callback,
+                                     void *context);
+
+// Stop receiving pushed values for a DataType subscribed to with dash_api_subscribe().
+// Parameters:
+//   type - The type of data to unsubscribe from.
+void dash_api_unsubscribe(DataType type);
+
 // Intialise the library by calling this function before any of the others.
 // Parameters:
 //   app_name - The name of your app. This will be used to allow the user to manage permissions.
@@ -108,6 +237,10 @@ void dash_api_get_feature(FeatureType type, DashAPIFeatureCallback *callback);
 //              using values of ErrorCode.
 void dash_api_init(char *app_name, DashAPIErrorCallback *callback);
 
+// Call when the app exits, to write any values received in the last few seconds that dash_api_persist_values()
+// has not yet stored.
+void dash_api_deinit();
+
 // Check to see if the Dash API is available. If the Android app is not installed, the request will
 // likely result in ErrorCodeUnavailable. The result will be delievered to the DashAPIErrorCallback
 // registered with dash_api_init().
@@ -121,7 +254,8 @@ void dash_api_check_is_available();
 //   char* - A human-readable string for this ErrorCode.
 char* dash_api_error_code_to_string(ErrorCode code);
 
-// Use within 10s of making a request to cancel the timeout and fake a response from the Android app.
+// Use before a request times out to cancel the timeout and fake a response from the Android app.
+// The fake response completes the oldest request in progress.
 // Useful for testing in the emulator, or if an Android phone is unavailable for testing.
 // Parameters:
 //   type          - The DataType of the fake response. In a real response, this will always match that of
@@ -148,9 +282,76 @@ void dash_api_fake_set_feature_response(FeatureType type, FeatureState new_state
 //   new_state - The current state of the FeatureType after being queried.
 void dash_api_fake_get_feature_response(FeatureType type, FeatureState new_state);
 
-// Use within 10s of making a request to cancel the timeout and fake an error from the Android app.
+// Use before a request times out to cancel the timeout and fake an error from the Android app.
 void dash_api_fake_error(ErrorCode code);
 
+// Cache values of a DataType received from the phone for a time, so that dash_api_get_data() can answer
+// immediately without a request. Once the cached value is older than ttl_s, it is still delivered
+// immediately but also refreshed in the background, and the callback is called again only if it changed.
+// String values longer than 63 characters are not cached. Caching is disabled by default.
+// Parameters:
+//   type - The DataType to cache.
+//   ttl_s - The number of seconds a cached value is fresh for, or 0 to disable caching for this DataType.
+void dash_api_set_cache_ttl(DataType type, int ttl_s);
+
+// Discard the cached value of a DataType, so the next dash_api_get_data() for it makes a request.
+// Parameters:
+//   type - The DataType to invalidate.
+void dash_api_invalidate_cache(DataType type);
+
+// Keep the last value received for each DataType in persistent storage, so that the next launch of the app can
+// show it with dash_api_get_cached() before any request completes. Values are loaded by this call, and written
+// a few seconds after they are received, when they have changed. Disabled by default.
+// Parameters:
+//   first_key - The first of 9 consecutive persist keys, one for each DataType, not otherwise used by the
+//               app. 0 stops persisting values.
+void dash_api_persist_values(uint32_t first_key);
+
+// Get the last value received for a DataType, either cached with dash_api_set_cache_ttl() or loaded by
+// dash_api_persist_values(), without making a request. String values remain valid until the next value of the
+// DataType is received.
+// Parameters:
+//   type  - The DataType to look up.
+//   value - Pointer to receive the value, may be NULL.
+//   age_s - Pointer to receive the number of seconds since the value was received, may be NULL.
+// Returns true if a value is known.
+bool dash_api_get_cached(DataType type, DataValue *value, int *age_s);
+
+// Get the number of dash_api_get_data() lookups that were answered from the cache, and the number of lookups
+// of cached DataTypes that had no value and required a request.
+// Parameters:
+//   hits   - Pointer to receive the number of cache hits, may be NULL.
+//   misses - Pointer to receive the number of cache misses, may be NULL.
+void dash_api_get_cache_stats(int *hits, int *misses);
+
+// Get counters of the library's activity, cheaply enough to keep on in released apps, for example to show on
+// a debug screen.
+// Parameters:
+//   out - Pointer to receive the counters.
+void dash_api_get_stats(DashAPIStats *out);
+
+// Set all the counters returned by dash_api_get_stats() and dash_api_get_cache_stats() to zero.
+void dash_api_reset_stats();
+
+// Send requests and receive responses in a compact binary form, rather than as AppMessage dictionaries.
+// This roughly halves the bytes sent over Bluetooth, and lets a batch of DataTypes be answered in fewer
+// responses. Requires Dash API Android app 1.8 or later, and a build with DASH_API_PACKED.
+// Parameters:
+//   packed - true to use the packed format. Default is false
+void dash_api_set_packed_format(bool packed);
+
+// Set how requests that could not be sent are retried, such as when the outbox is busy, the phone NACKs them or
+// Bluetooth is briefly disconnected. Each retry waits twice as long as the one before, up to 4 seconds, with
+// random jitter, and reconnection retries at once. ErrorCodeSendingFailed is reported only once max_attempts
+// have failed, or the next retry would be more than deadline_ms after the request was made. Default is 5
+// attempts from 250 ms, with a deadline of 10 seconds.
+// Parameters:
+//   max_attempts - Attempts to send each request, including the first. 1 disables retries, so that requests
+//                  made while disconnected fail at once.
+//   initial_delay_ms - Wait before the first retry.
+//   deadline_ms - Time from making a request after which it is no longer retried.
+void dash_api_set_retry_policy(int max_attempts, int initial_delay_ms, int deadline_ms);
+
 // Log all outgoing requests
 // Parameters:
 //   log_requests - true to log all outgoing requests. Default is false
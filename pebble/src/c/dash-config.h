@@ -0,0 +1,64 @@
+#pragma once
+
+// Compile-time configuration, to leave out the parts of the library an app does not use. Each can be defined
+// when building the package from source, such as with `pebble build -- --dash-api-config=DASH_API_FAKES=0`,
+// and the app then installs that build. Defines in the app's own build do not reach the package, so the
+// published package always has every part. Calls to functions that are left out fail to link.
+
+// APP_LOG messages from the library
+#ifndef DASH_API_LOGGING
+#define DASH_API_LOGGING 1
+#endif
+
+// Names of DataTypes, FeatureTypes and FeatureStates for dash_api_log_requests(), which logs nothing without them
+#ifndef DASH_API_DEBUG_NAMES
+#define DASH_API_DEBUG_NAMES 1
+#endif
+
+// dash_api_fake_*() responses, for testing
+#ifndef DASH_API_FAKES
+#define DASH_API_FAKES 1
+#endif
+
+// dash_api_set_feature(), dash_api_set_features() and their _with_context variants
+#ifndef DASH_API_SET_FEATURE
+#define DASH_API_SET_FEATURE 1
+#endif
+
+// The cache of received values: dash_api_set_cache_ttl(), dash_api_invalidate_cache(), dash_api_get_cached(),
+// dash_api_get_cache_stats(), and value hashes sent so that the phone can reply that a value is unchanged
+#ifndef DASH_API_CACHE
+#define DASH_API_CACHE 1
+#endif
+
+// dash_api_persist_values() and the values written by dash_api_deinit(). Requires DASH_API_CACHE.
+#ifndef DASH_API_PERSIST
+#define DASH_API_PERSIST DASH_API_CACHE
+#endif
+
+// dash_api_subscribe(), dash_api_unsubscribe() and the values the phone pushes for them
+#ifndef DASH_API_SUBSCRIBE
+#define DASH_API_SUBSCRIBE 1
+#endif
+
+// dash_api_schedule(), dash_api_schedule_with_context() and dash_api_unschedule()
+#ifndef DASH_API_SCHEDULE
+#define DASH_API_SCHEDULE 1
+#endif
+
+// Maximum number of requests waiting for the outbox or a response. Each takes a few dozen bytes of RAM.
+#ifndef DASH_API_QUEUE_SIZE
+#define DASH_API_QUEUE_SIZE 8
+#endif
+
+// dash_api_set_packed_format() and the packed message codec
+#ifndef DASH_API_PACKED
+#define DASH_API_PACKED 1
+#endif
+
+// The DataTypes that may be requested, with a bit for each in DataType order from bit 0 for
+// DataTypeBatteryPercent. The inbox and outbox are sized for the largest messages these can produce, and
+// requests for others fail.
+#ifndef DASH_API_DATA_TYPES
+#define DASH_API_DATA_TYPES 0x1FF
+#endif
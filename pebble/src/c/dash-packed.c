@@ -0,0 +1,201 @@
+#include "dash-packed.h"
+
+#include "dash-config.h"
+
+#if DASH_API_PACKED
+
+#define APP_KEY_BASE      47836    // AppKeyFeatureType
+#define REQUEST_TYPE_BASE 24784    // RequestTypeGetData
+#define DATA_TYPE_BASE    678342   // DataTypeBatteryPercent
+#define CODE_RANGE        16
+
+#define TUPLE_HEADER_SIZE 7   // Key, type and length of each dictionary tuple
+
+/********************************** Writer ************************************/
+
+static void put_byte(DashPackedWriter *writer, uint8_t byte) {
+  if(writer->length >= writer->size) {
+    writer->overflow = true;
+    return;
+  }
+
+  writer->buffer[writer->length++] = byte;
+}
+
+static void put_varint(DashPackedWriter *writer, uint32_t value) {
+  while(value >= 0x80) {
+    put_byte(writer, (value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  put_byte(writer, value);
+}
+
+static int key_code(uint32_t key) {
+  if(key >= APP_KEY_BASE && key < APP_KEY_BASE + CODE_RANGE) {
+    return key - APP_KEY_BASE;
+  }
+  if(key >= REQUEST_TYPE_BASE && key < REQUEST_TYPE_BASE + CODE_RANGE) {
+    return CODE_RANGE + key - REQUEST_TYPE_BASE;
+  }
+  if(key >= DATA_TYPE_BASE && key < DATA_TYPE_BASE + CODE_RANGE) {
+    return 2 * CODE_RANGE + key - DATA_TYPE_BASE;
+  }
+  return DASH_PACKED_CODE_ESCAPE;
+}
+
+static void put_key(DashPackedWriter *writer, uint32_t key, int kind) {
+  int code = key_code(key);
+  put_byte(writer, (code << 2) | kind);
+  if(code == DASH_PACKED_CODE_ESCAPE) {
+    put_varint(writer, key);
+  }
+}
+
+void dash_packed_begin(DashPackedWriter *writer, uint8_t *buffer, int size) {
+  writer->buffer = buffer;
+  writer->size = size;
+  writer->length = 0;
+  writer->overflow = false;
+  put_byte(writer, DASH_PACKED_VERSION);
+}
+
+void dash_packed_put_integer(DashPackedWriter *writer, uint32_t key, int32_t value) {
+  put_key(writer, key, DASH_PACKED_KIND_INTEGER);
+  put_varint(writer, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+void dash_packed_put_string(DashPackedWriter *writer, uint32_t key, const char *string) {
+  int length = strlen(string) + 1;
+  put_key(writer, key, DASH_PACKED_KIND_STRING);
+  put_varint(writer, length);
+  for(int i = 0; i < length; i++) {
+    put_byte(writer, string[i]);
+  }
+}
+
+/********************************** Reader ************************************/
+
+typedef struct {
+  const uint8_t *data;
+  int length;
+  int offset;
+} Reader;
+
+typedef struct {
+  uint32_t key;
+  int kind;
+  int32_t integer_value;
+  const char *string_value;   // Terminated within the message
+  int string_length;          // Including the terminator
+} Entry;
+
+static bool get_varint(Reader *reader, uint32_t *value) {
+  *value = 0;
+  for(int shift = 0; shift < 35; shift += 7) {
+    if(reader->offset >= reader->length) {
+      return false;
+    }
+
+    uint8_t byte = reader->data[reader->offset++];
+    *value |= (uint32_t)(byte & 0x7F) << shift;
+    if(!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Read the next entry. Returns false at the end of the message, or if it is not valid.
+static bool get_entry(Reader *reader, Entry *entry, bool *valid) {
+  *valid = true;
+  if(reader->offset >= reader->length) {
+    return false;
+  }
+
+  uint8_t header = reader->data[reader->offset++];
+  int code = header >> 2;
+  entry->kind = header & 0x3;
+  if(code == DASH_PACKED_CODE_ESCAPE) {
+    *valid = get_varint(reader, &entry->key);
+  } else if(code < CODE_RANGE) {
+    entry->key = APP_KEY_BASE + code;
+  } else if(code < 2 * CODE_RANGE) {
+    entry->key = REQUEST_TYPE_BASE + code - CODE_RANGE;
+  } else if(code < 3 * CODE_RANGE) {
+    entry->key = DATA_TYPE_BASE + code - 2 * CODE_RANGE;
+  } else {
+    *valid = false;
+  }
+
+  uint32_t value;
+  *valid = *valid && get_varint(reader, &value);
+  if(!*valid) {
+    return false;
+  }
+
+  switch(entry->kind) {
+    case DASH_PACKED_KIND_INTEGER:
+      entry->integer_value = (int32_t)((value >> 1) ^ -(value & 1));
+      return true;
+
+    case DASH_PACKED_KIND_STRING:
+      if(value == 0 || value > (uint32_t)(reader->length - reader->offset)
+          || reader->data[reader->offset + value - 1] != '\0') {
+        *valid = false;
+        return false;
+      }
+      entry->string_value = (const char*)&reader->data[reader->offset];
+      entry->string_length = value;
+      reader->offset += value;
+      return true;
+
+    default:
+      *valid = false;
+      return false;
+  }
+}
+
+static bool begin_reader(Reader *reader, const uint8_t *data, int length) {
+  reader->data = data;
+  reader->length = length;
+  reader->offset = 1;
+  return data && length > 0 && data[0] == DASH_PACKED_VERSION;
+}
+
+uint32_t dash_packed_unpacked_size(const uint8_t *data, int length) {
+  Reader reader;
+  if(!begin_reader(&reader, data, length)) {
+    return 0;
+  }
+
+  uint32_t size = 1;   // Tuple count
+  Entry entry;
+  bool valid;
+  while(get_entry(&reader, &entry, &valid)) {
+    size += TUPLE_HEADER_SIZE + ((entry.kind == DASH_PACKED_KIND_STRING) ? entry.string_length : (int)sizeof(int32_t));
+  }
+  return valid ? size : 0;
+}
+
+bool dash_packed_unpack(const uint8_t *data, int length, DictionaryIterator *out, uint8_t *buffer, uint16_t size) {
+  Reader reader;
+  if(!begin_reader(&reader, data, length) || dict_write_begin(out, buffer, size) != DICT_OK) {
+    return false;
+  }
+
+  Entry entry;
+  bool valid;
+  while(get_entry(&reader, &entry, &valid)) {
+    DictionaryResult result = (entry.kind == DASH_PACKED_KIND_STRING)
+      ? dict_write_cstring(out, entry.key, entry.string_value)
+      : dict_write_int32(out, entry.key, entry.integer_value);
+    if(result != DICT_OK) {
+      return false;
+    }
+  }
+
+  dict_write_end(out);
+  return valid;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <pebble.h>
+
+// Packed message format, shared with android/.../dash/Packed.java
+//
+// A packed message is a single TUPLE_BYTE_ARRAY under AppKeyPacked, holding the same keys and values as the
+// dictionary it replaces:
+//
+//   version                  - 1 byte, DASH_PACKED_VERSION
+//   entries, each:
+//     header                 - 1 byte, (key code << 2) | kind
+//     [key]                  - varint, only if the key code is DASH_PACKED_CODE_ESCAPE
+//     value                  - kind DASH_PACKED_KIND_INTEGER: zigzag varint
+//                              kind DASH_PACKED_KIND_STRING: varint length including the terminator, then the
+//                              string and its terminator
+//
+// Key codes 0-15 are AppKeys, 16-31 RequestTypes and 32-47 DataTypes, relative to the first of each. Other
+// keys use DASH_PACKED_CODE_ESCAPE. Varints are unsigned LEB128.
+
+#define DASH_PACKED_VERSION 1
+
+#define DASH_PACKED_KIND_INTEGER 0
+#define DASH_PACKED_KIND_STRING  1
+
+#define DASH_PACKED_CODE_ESCAPE 63
+
+typedef struct {
+  uint8_t *buffer;
+  int size;
+  int length;
+  bool overflow;   // Set if any value did not fit
+} DashPackedWriter;
+
+// Begin a packed message in buffer, writing the version
+void dash_packed_begin(DashPackedWriter *writer, uint8_t *buffer, int size);
+
+void dash_packed_put_integer(DashPackedWriter *writer, uint32_t key, int32_t value);
+
+void dash_packed_put_string(DashPackedWriter *writer, uint32_t key, const char *string);
+
+// Returns the size of the dictionary that a packed message unpacks into, or 0 if it is not valid
+uint32_t dash_packed_unpacked_size(const uint8_t *data, int length);
+
+// Unpack a packed message into a dictionary written to buffer, of at least dash_packed_unpacked_size().
+// String values are copied. Returns false if the message is not valid.
+bool dash_packed_unpack(const uint8_t *data, int length, DictionaryIterator *out, uint8_t *buffer, uint16_t size);
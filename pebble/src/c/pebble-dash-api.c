@@ -3,17 +3,56 @@
 #include <pebble-events/pebble-events.h>
 #include <pebble-packet/pebble-packet.h> 
 
-#define INBOX_SIZE  256
-#define OUTBOX_SIZE 256
+#include "dash-config.h"
+#if DASH_API_PACKED
+#include "dash-packed.h"
+#endif
+
+#if DASH_API_PERSIST && !DASH_API_CACHE
+#error "DASH_API_PERSIST requires DASH_API_CACHE"
+#endif
+
+#define MAX_INBOX_SIZE 256   // Larger responses are rare, so the inbox is no larger even if they are possible
+#define PACKED_OVERHEAD 8   // Dictionary and tuple headers around a packed message
+#define PACKED_TUPLE_SAVING 5   // A packed entry is at least this much smaller than the tuple it replaces
+#define APP_NAME_SIZE 32
+#define MAX_STRING_SIZE 64   // Longest string value the phone sends, with its terminator
 #define DELAY_MS    200   // Enable opening AppMessage and an API query in the same event loop
 #define TIMEOUT_MS  10000 // 10s for the Android app to respond, or it is assumed MIA
+#define MIN_TIMEOUT_MS 750 // Lower bound of the timeout estimated from measured round trip times
+#define PROVIDER_MIN_TIMEOUT_MS 3000 // As MIN_TIMEOUT_MS, for requests the phone answers from a content provider
+#define QUEUE_SIZE  DASH_API_QUEUE_SIZE // Maximum number of requests waiting for the outbox or a response
+#define MAX_IN_FLIGHT 3   // Maximum number of requests awaiting a response at once
+#define BACKGROUND_MAX_WAIT_MS 2000 // A background request waiting this long is sent ahead of interactive ones
+#define CACHE_STRING_SIZE 64  // Longer string values are not cached
+#define PERSIST_DELAY_MS 5000 // Received values are written to persistent storage together, this long after the first
+#define PERSIST_REFRESH_S 600 // An unchanged value is written again only when its stored timestamp is this old
+#define PERSIST_VERSION  1
+#define SCHEDULE_WINDOW_S 60  // Scheduled refreshes due before the next minute tick are sent together at this one
+#define RETRY_MAX_ATTEMPTS 5  // Default attempts to send a request, including the first
+#define RETRY_DELAY_MS   250  // Default wait before the first retry, doubled for each after it
+#define RETRY_MAX_DELAY_MS 4000 // Longest wait between retries
+
+#if DASH_API_LOGGING
+#define DASH_LOG(level, ...) APP_LOG(level, __VA_ARGS__)
+#else
+#define DASH_LOG(level, ...)
+#endif
+
+#if DASH_API_LOGGING && DASH_API_DEBUG_NAMES
+#define LOG_REQUEST(...) if(s_log_requests) { APP_LOG(APP_LOG_LEVEL_DEBUG, __VA_ARGS__); }
+#else
+#define LOG_REQUEST(...)
+#endif
 
 typedef enum {
   RequestTypeGetData = 24784,
   RequestTypeSetFeature = 24785,
   RequestTypeGetFeature = 24786,
   RequestTypeError = 24787,
-  RequestTypeIsAvailable = 24788
+  RequestTypeIsAvailable = 24788,
+  RequestTypeSubscribe = 24789,
+  RequestTypeUnsubscribe = 24790
 } RequestType;
 
 typedef enum {
@@ -24,25 +63,224 @@ typedef enum {
   AppKeyUsesDashAPI = 47840,
   AppKeyAppName = 47841,
   AppKeyErrorCode = 47842,
-  AppKeyLibraryVersion = 47843
+  AppKeyLibraryVersion = 47843,
+  AppKeyMinInterval = 47844,
+  AppKeyPush = 47845,
+  AppKeySession = 47846,
+  AppKeyRequestId = 47847,
+  AppKeyPacked = 47848,
+  AppKeyValueHash = 47849,
+  AppKeyNotModified = 47850
 } AppKey;
 
-static DashAPIDataCallback *s_last_get_data_cb;
-static DashAPIFeatureCallback *s_last_set_feature_cb, *s_last_get_feature_cb;
+#define NUM_DATA_TYPES           (DataTypeNextCalendarEventTwoLine - DataTypeBatteryPercent + 1)
+#define DATA_TYPE_BIT(data_type) (1 << ((data_type) - DataTypeBatteryPercent))
+#define NUM_STRING_DATA_TYPES    5
+#define NUM_REQUEST_TYPES        (RequestTypeUnsubscribe - RequestTypeGetData + 1)
+#define RTT_CLASS_PROVIDER       NUM_REQUEST_TYPES   // Data requests with a PROVIDER_DATA_TYPES value
+#define NUM_RTT_CLASSES          (NUM_REQUEST_TYPES + 1)
+#define NUM_FEATURE_TYPES        (FeatureTypeAutoBrightness - FeatureTypeWifi + 1)
+#define FEATURE_STATE_SHIFT(feature_type) (4 * ((feature_type) - FeatureTypeWifi))
+
+// DataTypes the phone looks up with content provider queries, which take seconds when cold, where others are
+// answered from memory
+#define PROVIDER_DATA_TYPES (DATA_TYPE_BIT(DataTypeUnreadSMSCount) | DATA_TYPE_BIT(DataTypeNextCalendarEventOneLine) \
+  | DATA_TYPE_BIT(DataTypeNextCalendarEventTwoLine))
+
+// Message sizes, from the dictionary header of 1 byte and a 7 byte header for each tuple
+#define INTEGER_TUPLE_SIZE      11
+#define STRING_TUPLE_SIZE(size) (7 + (size))   // Including the terminator
+#define RESPONSE_HEADER_TUPLES  6    // AppKeyRequestId, RequestTypeError, AppKeyErrorCode, the RequestType,
+                                     // AppKeyNotModified and AppKeySession, the most any response holds
+#define NUM_ENABLED_DATA_TYPES  ((DASH_API_DATA_TYPES & 1) + ((DASH_API_DATA_TYPES >> 1) & 1) \
+  + ((DASH_API_DATA_TYPES >> 2) & 1) + ((DASH_API_DATA_TYPES >> 3) & 1) + ((DASH_API_DATA_TYPES >> 4) & 1) \
+  + ((DASH_API_DATA_TYPES >> 5) & 1) + ((DASH_API_DATA_TYPES >> 6) & 1) + ((DASH_API_DATA_TYPES >> 7) & 1) \
+  + ((DASH_API_DATA_TYPES >> 8) & 1))
+
+// The largest request is the first, with the app name and version, getting every enabled DataType in a batch,
+// setting every FeatureType, or getting one DataType with a value hash
+#define REQUEST_HEADER_SIZE (1 + 2 * INTEGER_TUPLE_SIZE + STRING_TUPLE_SIZE(APP_NAME_SIZE) \
+  + STRING_TUPLE_SIZE(sizeof(ANDROID_APP_VERSION)))
+#define BATCH_REQUEST_SIZE ((1 + NUM_ENABLED_DATA_TYPES) * INTEGER_TUPLE_SIZE)
+#define SET_FEATURES_REQUEST_SIZE (DASH_API_SET_FEATURE ? (1 + NUM_FEATURE_TYPES) * INTEGER_TUPLE_SIZE : 0)
+#define SINGLE_REQUEST_SIZE (3 * INTEGER_TUPLE_SIZE)
+#define LARGER(a, b) (((a) > (b)) ? (a) : (b))
+#define OUTBOX_SIZE (REQUEST_HEADER_SIZE \
+  + LARGER(LARGER(BATCH_REQUEST_SIZE, SET_FEATURES_REQUEST_SIZE), SINGLE_REQUEST_SIZE))
+
+// The largest response is to a request for every enabled DataType in a batch, for one DataType, or for the
+// state of each FeatureType, up to MAX_INBOX_SIZE
+#define LONG_STRING_TUPLE_SIZE  STRING_TUPLE_SIZE(MAX_STRING_SIZE)
+#define WIFI_TUPLE_SIZE         STRING_TUPLE_SIZE(33)   // SSIDs are at most 32 bytes
+#define STORAGE_TUPLE_SIZE      STRING_TUPLE_SIZE(16)
+#define DATA_TYPE_ENABLED(data_type) ((DASH_API_DATA_TYPES & DATA_TYPE_BIT(data_type)) ? 1 : 0)
+#define LONG_STRING_DATA_TYPES  (DATA_TYPE_BIT(DataTypeGSMOperatorName) \
+  | DATA_TYPE_BIT(DataTypeNextCalendarEventOneLine) | DATA_TYPE_BIT(DataTypeNextCalendarEventTwoLine))
+#define VALUES_SIZE (NUM_ENABLED_DATA_TYPES * INTEGER_TUPLE_SIZE \
+  + DATA_TYPE_ENABLED(DataTypeWifiNetworkName) * (WIFI_TUPLE_SIZE - INTEGER_TUPLE_SIZE) \
+  + DATA_TYPE_ENABLED(DataTypeStorageFreeGBString) * (STORAGE_TUPLE_SIZE - INTEGER_TUPLE_SIZE) \
+  + (DATA_TYPE_ENABLED(DataTypeGSMOperatorName) + DATA_TYPE_ENABLED(DataTypeNextCalendarEventOneLine) \
+    + DATA_TYPE_ENABLED(DataTypeNextCalendarEventTwoLine)) * (LONG_STRING_TUPLE_SIZE - INTEGER_TUPLE_SIZE))
+#define LARGEST_VALUE_TUPLE_SIZE ((DASH_API_DATA_TYPES & LONG_STRING_DATA_TYPES) ? LONG_STRING_TUPLE_SIZE \
+  : DATA_TYPE_ENABLED(DataTypeWifiNetworkName) ? WIFI_TUPLE_SIZE \
+  : DATA_TYPE_ENABLED(DataTypeStorageFreeGBString) ? STORAGE_TUPLE_SIZE : INTEGER_TUPLE_SIZE)
+#define RESPONSE_HEADER_SIZE (1 + RESPONSE_HEADER_TUPLES * INTEGER_TUPLE_SIZE)
+#define RESPONSE_SIZE (RESPONSE_HEADER_SIZE \
+  + LARGER(LARGER(VALUES_SIZE, INTEGER_TUPLE_SIZE + LARGEST_VALUE_TUPLE_SIZE), NUM_FEATURE_TYPES * INTEGER_TUPLE_SIZE))
+#define INBOX_SIZE ((RESPONSE_SIZE < MAX_INBOX_SIZE) ? RESPONSE_SIZE : MAX_INBOX_SIZE)
+
+// A packed response fills the inbox with more tuples than a dictionary would, so it unpacks to more than
+// INBOX_SIZE, but never more than the largest response
+#define PACKED_RESPONSE_TUPLES (RESPONSE_HEADER_TUPLES + LARGER(NUM_ENABLED_DATA_TYPES, NUM_FEATURE_TYPES))
+#define UNPACK_SIZE LARGER(INBOX_SIZE, \
+  (RESPONSE_SIZE < INBOX_SIZE - PACKED_OVERHEAD + PACKED_RESPONSE_TUPLES * PACKED_TUPLE_SAVING) ? RESPONSE_SIZE \
+  : INBOX_SIZE - PACKED_OVERHEAD + PACKED_RESPONSE_TUPLES * PACKED_TUPLE_SAVING)
+
+// Interactive requests are sent ahead of background ones, and always have an in-flight slot free for them
+typedef enum {
+  LaneInteractive = 0,   // Feature, subscription and availability requests
+  LaneBackground         // Data requests, including scheduled refreshes
+} Lane;
+
+typedef enum {
+  RequestStatusFree = 0,
+  RequestStatusWaiting,   // Queued for the outbox
+  RequestStatusInFlight   // Sent, and awaiting a response
+} RequestStatus;
+
+// A request waiting to be sent, or awaiting its response
+typedef struct {
+  RequestStatus status;
+  uint8_t id;                              // Echoed by the phone in AppKeyRequestId
+  uint16_t order;                          // Order of queueing, so that the oldest is sent first
+  Lane lane;
+  uint32_t queued_ms;
+  uint32_t sent_ms;
+  uint8_t attempts;                        // Failed attempts to send
+  uint32_t retry_ms;                       // While retrying, not sent again before this time
+  AppTimer *timeout_timer;
+  RequestType request_type;
+  int type;                                // DataType or FeatureType, depending on request_type
+  uint16_t data_types;                     // RequestTypeGetData only, DATA_TYPE_BIT() of each DataType requested
+  uint16_t revalidate_types;               // Of data_types, those already answered with a stale cached value
+#if DASH_API_SET_FEATURE
+  FeatureState feature_state;              // RequestTypeSetFeature only
+  uint32_t feature_states;                 // RequestTypeSetFeature of several only, the FeatureState of each
+                                           // FeatureType at FEATURE_STATE_SHIFT(), or 0 if not set
+#endif
+#if DASH_API_SUBSCRIBE
+  int min_interval_ms;                     // RequestTypeSubscribe only
+#endif
+  DashAPIDataCallback *data_callback;      // RequestTypeGetData only, one of data_callback or data_context_callback
+  DashAPIDataContextCallback *data_context_callback;
+  DashAPIFeatureCallback *feature_callback; // Feature requests only, one of feature_callback or feature_context_callback
+  DashAPIFeatureContextCallback *feature_context_callback;
+  void *context;                           // Passed to the context callbacks
+} Request;
+
+// The last value received for a DataType with a cache TTL set
+typedef struct {
+  bool valid;
+  time_t updated;
+  int ttl_s;
+  int integer_value;
+} CacheEntry;
+
+// Round trip time estimate for a RequestType, or for data requests answered from a content provider, as for
+// TCP's retransmission timeout (RFC 6298)
+typedef struct {
+  int srtt_ms;     // Smoothed round trip time, or 0 before the first sample
+  int rttvar_ms;   // Round trip time variation
+  int timeout_ms;
+} RttEstimate;
+
+// A cached value as written to persistent storage, with only as much of string_value as it uses
+typedef struct {
+  uint8_t version;
+  int32_t updated;
+  int32_t integer_value;
+  char string_value[CACHE_STRING_SIZE];
+} PersistedValue;
+
+// The callback for values pushed for a subscription from dash_api_subscribe()
+typedef struct {
+  DashAPIDataCallback *callback;
+  DashAPIDataContextCallback *context_callback;
+  void *context;
+} Subscription;
+
+// A periodic refresh of a DataType from dash_api_schedule()
+typedef struct {
+  int period_s;    // 0 if not scheduled
+  time_t due;
+  DashAPIDataCallback *callback;
+  DashAPIDataContextCallback *context_callback;
+  void *context;
+} Schedule;
+
+// From dash_api_set_retry_policy()
+typedef struct {
+  int max_attempts;
+  int initial_delay_ms;
+  int deadline_ms;
+} RetryPolicy;
+
+typedef enum {
+  CacheResultMiss = 0,
+  CacheResultFresh,
+  CacheResultStale
+} CacheResult;
+
 static DashAPIErrorCallback *s_error_callback;
 
-static AppTimer *s_timeout_timer, *s_send_timer;
-static FeatureType s_last_get_feature_type, s_last_set_feature_type;
-static DataType s_last_get_data_type;
-static char s_app_name[32];
-static bool s_in_flight, s_initialized, s_log_requests;
+#if DASH_API_SUBSCRIBE
+static Subscription s_subscriptions[NUM_DATA_TYPES];
+#endif
+#if DASH_API_CACHE
+static CacheEntry s_cache[NUM_DATA_TYPES];
+static char s_cache_strings[NUM_STRING_DATA_TYPES][CACHE_STRING_SIZE];
+#endif
+#if DASH_API_PERSIST
+static uint16_t s_persist_dirty;              // DATA_TYPE_BITs of values still to be written
+static time_t s_persisted[NUM_DATA_TYPES];    // When each value was last written
+static uint32_t s_persist_key;                // First of the app's persist keys used for values, or 0 if disabled
+static AppTimer *s_persist_timer;
+#endif
+
+#if DASH_API_SCHEDULE
+static Schedule s_schedules[NUM_DATA_TYPES];
+static EventHandle s_tick_handle;    // While any refresh is scheduled
+static AppTimer *s_schedule_timer;   // First window after a refresh is scheduled
+#endif
+
+static DashAPIStats s_stats;
+
+static RttEstimate s_rtt[NUM_RTT_CLASSES];
+
+static Request s_requests[QUEUE_SIZE];
+static int s_in_flight_count;
+static uint16_t s_next_order;
+static uint8_t s_last_id, s_outbox_request_id;
+
+static AppTimer *s_send_timer;
+static AppTimer *s_retry_timer;   // Until the first waiting request may be retried
+static RetryPolicy s_retry = { RETRY_MAX_ATTEMPTS, RETRY_DELAY_MS, TIMEOUT_MS };
+static char s_app_name[APP_NAME_SIZE];
+static int s_session;   // Token issued by the phone in place of the full header, or 0 before the handshake
+static bool s_outbox_busy, s_initialized, s_log_requests, s_link_open;
+#if DASH_API_PACKED
+static bool s_packed_format;
+static DashPackedWriter *s_packed_writer;   // While writing a packed message, or NULL when writing with pebble-packet
+static uint8_t s_unpack_buffer[UNPACK_SIZE];   // Dictionary a packed response is unpacked into
+#endif
 
 /********************************* Internal ***********************************/
 
 static bool data_type_is_valid(DataType type) {
-  bool valid = type >= DataTypeBatteryPercent && type <= DataTypeNextCalendarEventTwoLine;
+  bool valid = type >= DataTypeBatteryPercent && type <= DataTypeNextCalendarEventTwoLine
+    && (DASH_API_DATA_TYPES & DATA_TYPE_BIT(type));
   if(!valid) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: DataType is not valid: %d", type);
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: DataType is not valid: %d", type);
   }
   return valid;
 }
@@ -50,169 +288,817 @@ static bool data_type_is_valid(DataType type) {
 static bool feature_type_is_valid(FeatureType type) {
   bool valid = type >= FeatureTypeWifi && type <= FeatureTypeAutoBrightness;
   if(!valid) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: FeatureType is not valid: %d", type);
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: FeatureType is not valid: %d", type);
   }
   return valid;
 }
 
+#if DASH_API_SET_FEATURE
 static bool feature_state_is_valid(FeatureState state) {
   bool valid = state >= FeatureStateOff && state <= FeatureStateRingerSilent;
   if(!valid) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: FeatureState is not valid: %d" + state);
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: FeatureState is not valid: %d", state);
   }
   return valid;
 }
+#endif
+
+// Largest tuple the phone sends with the value of a DataType
+static int value_tuple_size(DataType type) {
+  switch(type) {
+    case DataTypeWifiNetworkName:     return WIFI_TUPLE_SIZE;
+    case DataTypeStorageFreeGBString: return STORAGE_TUPLE_SIZE;
+    case DataTypeGSMOperatorName:
+    case DataTypeNextCalendarEventOneLine:
+    case DataTypeNextCalendarEventTwoLine:
+      return LONG_STRING_TUPLE_SIZE;
+    default:
+      return INTEGER_TUPLE_SIZE;
+  }
+}
+
+// As value_tuple_size(), in the format responses arrive in
+static int response_tuple_size(DataType type) {
+#if DASH_API_PACKED
+  if(s_packed_format) {
+    return value_tuple_size(type) - PACKED_TUPLE_SAVING;
+  }
+#endif
+  return value_tuple_size(type);
+}
 
-static void cancel_timeout_timer() {
-  if(s_timeout_timer) {
-    app_timer_cancel(s_timeout_timer);
-    s_timeout_timer = NULL;
+// Largest response holding no values, in the format responses arrive in
+static int response_header_size() {
+#if DASH_API_PACKED
+  if(s_packed_format) {
+    return RESPONSE_HEADER_SIZE + PACKED_OVERHEAD - RESPONSE_HEADER_TUPLES * PACKED_TUPLE_SAVING;
   }
+#endif
+  return RESPONSE_HEADER_SIZE;
 }
 
+#if DASH_API_FAKES
 static void cancel_send_timer() {
   if(s_send_timer) {
     app_timer_cancel(s_send_timer);
     s_send_timer = NULL;
   }
 }
+#endif
+
+/********************************** Cache *************************************/
+
+#if DASH_API_CACHE
+// Index into s_cache_strings for string DataTypes, or -1 for integer DataTypes
+static int cache_string_slot(int type) {
+  switch(type) {
+    case DataTypeGSMOperatorName:          return 0;
+    case DataTypeWifiNetworkName:          return 1;
+    case DataTypeStorageFreeGBString:      return 2;
+    case DataTypeNextCalendarEventOneLine: return 3;
+    case DataTypeNextCalendarEventTwoLine: return 4;
+    default:                               return -1;
+  }
+}
+
+static CacheResult cache_lookup(int type, DataValue *value) {
+  CacheEntry *entry = &s_cache[type - DataTypeBatteryPercent];
+  if(entry->ttl_s <= 0) {
+    return CacheResultMiss;
+  }
+
+  if(!entry->valid) {
+    s_stats.cache_misses++;
+    return CacheResultMiss;
+  }
+
+  s_stats.cache_hits++;
+  int slot = cache_string_slot(type);
+  value->integer_value = entry->integer_value;
+  value->string_value = (slot >= 0) ? s_cache_strings[slot] : NULL;
+  return (time(NULL) - entry->updated < entry->ttl_s) ? CacheResultFresh : CacheResultStale;
+}
+
+#if DASH_API_PERSIST
+static void persist_flush(void *context) {
+  s_persist_timer = NULL;
+  if(!s_persist_key) {
+    s_persist_dirty = 0;
+    return;
+  }
+
+  for(int type = DataTypeBatteryPercent; type <= DataTypeNextCalendarEventTwoLine; type++) {
+    if(!(s_persist_dirty & DATA_TYPE_BIT(type))) {
+      continue;
+    }
+
+    CacheEntry *entry = &s_cache[type - DataTypeBatteryPercent];
+    PersistedValue persisted = {
+      .version = PERSIST_VERSION,
+      .updated = entry->updated,
+      .integer_value = entry->integer_value
+    };
+    int size = offsetof(PersistedValue, string_value);
+    int slot = cache_string_slot(type);
+    if(slot >= 0) {
+      strcpy(persisted.string_value, s_cache_strings[slot]);
+      size += strlen(persisted.string_value) + 1;
+    }
+
+    uint32_t key = s_persist_key + type - DataTypeBatteryPercent;
+    if(persist_write_data(key, &persisted, size) < 0) {
+      DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Error persisting DataType %d", type);
+    }
+    s_persisted[type - DataTypeBatteryPercent] = entry->updated;
+  }
+  s_persist_dirty = 0;
+}
+
+// Schedule writing a value just stored in the cache, if it changed or its stored timestamp is getting old
+static void persist_mark(int type, bool changed) {
+  if(!s_persist_key) {
+    return;
+  }
+
+  time_t updated = s_cache[type - DataTypeBatteryPercent].updated;
+  if(!changed && updated - s_persisted[type - DataTypeBatteryPercent] < PERSIST_REFRESH_S) {
+    return;
+  }
+
+  s_persist_dirty |= DATA_TYPE_BIT(type);
+  if(!s_persist_timer) {
+    s_persist_timer = app_timer_register(PERSIST_DELAY_MS, persist_flush, NULL);
+  }
+}
+
+static void persist_load() {
+  for(int type = DataTypeBatteryPercent; type <= DataTypeNextCalendarEventTwoLine; type++) {
+    PersistedValue persisted;
+    uint32_t key = s_persist_key + type - DataTypeBatteryPercent;
+    int size = persist_read_data(key, &persisted, sizeof(persisted));
+    int header_size = offsetof(PersistedValue, string_value);
+    if(size < header_size || persisted.version != PERSIST_VERSION) {
+      continue;
+    }
+
+    int slot = cache_string_slot(type);
+    if(slot >= 0 && (size == header_size || persisted.string_value[size - header_size - 1] != '\0')) {
+      continue;
+    }
+
+    CacheEntry *entry = &s_cache[type - DataTypeBatteryPercent];
+    if(entry->valid && entry->updated >= persisted.updated) {
+      continue;   // Already received a newer value
+    }
+    entry->valid = true;
+    entry->updated = persisted.updated;
+    entry->integer_value = persisted.integer_value;
+    if(slot >= 0) {
+      strcpy(s_cache_strings[slot], persisted.string_value);
+    }
+    s_persisted[type - DataTypeBatteryPercent] = persisted.updated;
+  }
+}
+#else
+static void persist_mark(int type, bool changed) {
+}
+#endif
+
+// FNV-1a hash of a string value, sent so that the phone can reply that it is unchanged. Never 0, which means there
+// is no value to compare.
+static int32_t value_hash(const char *string) {
+  uint32_t hash = 2166136261u;
+  while(*string) {
+    hash ^= (uint8_t)*string++;
+    hash *= 16777619u;
+  }
+  return hash ? (int32_t)hash : 1;
+}
+
+// Hash of the cached value of a string DataType, or 0 if there is none
+static int32_t cache_value_hash(int type) {
+  int slot = cache_string_slot(type);
+  return (slot >= 0 && s_cache[type - DataTypeBatteryPercent].valid) ? value_hash(s_cache_strings[slot]) : 0;
+}
+
+// Store a received value if its DataType is cached or persisted. Returns false if it is unchanged from the cached
+// value.
+static bool cache_store(int type, DataValue value) {
+  CacheEntry *entry = &s_cache[type - DataTypeBatteryPercent];
+#if DASH_API_PERSIST
+  bool persisted = s_persist_key != 0;
+#else
+  bool persisted = false;
+#endif
+  if(entry->ttl_s <= 0 && !persisted) {
+    return true;
+  }
+
+  int slot = cache_string_slot(type);
+  bool changed;
+  if(slot >= 0) {
+    changed = !entry->valid || strcmp(s_cache_strings[slot], value.string_value) != 0;
+    if(strlen(value.string_value) >= CACHE_STRING_SIZE) {
+      // Would be truncated
+      entry->valid = false;
+      return true;
+    }
+    strcpy(s_cache_strings[slot], value.string_value);
+  } else {
+    changed = !entry->valid || entry->integer_value != value.integer_value;
+    entry->integer_value = value.integer_value;
+  }
+
+  entry->valid = true;
+  entry->updated = time(NULL);
+  persist_mark(type, changed);
+  return changed;
+}
+#else
+// Without the cache every value is requested from the phone, and delivered as received
+static CacheResult cache_lookup(int type, DataValue *value) {
+  return CacheResultMiss;
+}
+
+static int32_t cache_value_hash(int type) {
+  return 0;
+}
+
+static bool cache_store(int type, DataValue value) {
+  return true;
+}
+#endif
+
+/*********************************** RTT **************************************/
+
+static uint32_t now_ms() {
+  time_t seconds;
+  uint16_t ms;
+  time_ms(&seconds, &ms);
+  return (uint32_t)seconds * 1000 + ms;
+}
+
+// Data requests answered from a content provider are estimated apart, so that the quick replies to others do
+// not shorten their timeout
+static int rtt_class(const Request *request) {
+  bool data_request = request->request_type == RequestTypeGetData || request->request_type == RequestTypeSubscribe;
+  if(data_request && (request->data_types & PROVIDER_DATA_TYPES)) {
+    return RTT_CLASS_PROVIDER;
+  }
+  return request->request_type - RequestTypeGetData;
+}
+
+static int clamp_timeout(int rtt_class, int timeout_ms) {
+  int min_timeout_ms = (rtt_class == RTT_CLASS_PROVIDER) ? PROVIDER_MIN_TIMEOUT_MS : MIN_TIMEOUT_MS;
+  if(timeout_ms < min_timeout_ms) {
+    return min_timeout_ms;
+  }
+  if(timeout_ms > TIMEOUT_MS) {
+    return TIMEOUT_MS;
+  }
+  return timeout_ms;
+}
+
+// Upper bounds of each DashAPIStats.rtt_histogram bucket but the last
+static const int s_rtt_bucket_ms[DASH_API_RTT_BUCKETS - 1] = { 50, 100, 200, 500, 1000, 2000, 5000 };
+
+static void rtt_sample(const Request *request, int rtt_ms) {
+  int bucket = 0;
+  while(bucket < DASH_API_RTT_BUCKETS - 1 && rtt_ms > s_rtt_bucket_ms[bucket]) {
+    bucket++;
+  }
+  s_stats.rtt_histogram[bucket]++;
+
+  int class = rtt_class(request);
+  RttEstimate *estimate = &s_rtt[class];
+  if(estimate->srtt_ms == 0) {
+    estimate->srtt_ms = rtt_ms;
+    estimate->rttvar_ms = rtt_ms / 2;
+  } else {
+    int error = rtt_ms - estimate->srtt_ms;
+    estimate->srtt_ms += error / 8;
+    estimate->rttvar_ms += ((error < 0 ? -error : error) - estimate->rttvar_ms) / 4;
+  }
+  estimate->timeout_ms = clamp_timeout(class, estimate->srtt_ms + 4 * estimate->rttvar_ms);
+}
+
+// Back off after a timeout, in case the phone has become slower
+static void rtt_backoff(const Request *request) {
+  int class = rtt_class(request);
+  RttEstimate *estimate = &s_rtt[class];
+  if(estimate->timeout_ms) {
+    estimate->timeout_ms = clamp_timeout(class, estimate->timeout_ms * 2);
+  }
+}
+
+static int rtt_timeout(const Request *request) {
+  int timeout_ms = s_rtt[rtt_class(request)].timeout_ms;
+  return timeout_ms ? timeout_ms : TIMEOUT_MS;
+}
+
+/********************************** Queue *************************************/
+
+static Request* request_find(int id) {
+  for(int i = 0; i < QUEUE_SIZE; i++) {
+    if(s_requests[i].status != RequestStatusFree && s_requests[i].id == id) {
+      return &s_requests[i];
+    }
+  }
+  return NULL;
+}
+
+// The request with the given status that was queued first
+static Request* request_oldest(RequestStatus status) {
+  Request *oldest = NULL;
+  for(int i = 0; i < QUEUE_SIZE; i++) {
+    Request *request = &s_requests[i];
+    if(request->status == status && (!oldest || (int16_t)(request->order - oldest->order) < 0)) {
+      oldest = request;
+    }
+  }
+  return oldest;
+}
+
+static void request_remove(Request *request) {
+  if(request->timeout_timer) {
+    app_timer_cancel(request->timeout_timer);
+    request->timeout_timer = NULL;
+  }
+  if(request->status == RequestStatusInFlight) {
+    s_in_flight_count--;
+  }
+
+  request->status = RequestStatusFree;
+  request->id = 0;
+}
+
+// Whether a waiting request is not backing off before a retry
+static bool request_ready(Request *request) {
+  return request->attempts == 0 || (int32_t)(request->retry_ms - now_ms()) <= 0;
+}
+
+// The waiting request of a lane that was queued first, or last. If ready, only those that may be sent now.
+static Request* request_waiting(Lane lane, bool newest, bool ready) {
+  Request *found = NULL;
+  for(int i = 0; i < QUEUE_SIZE; i++) {
+    Request *request = &s_requests[i];
+    if(request->status != RequestStatusWaiting || request->lane != lane || (ready && !request_ready(request))) {
+      continue;
+    }
+
+    int16_t age = request->order - (found ? found->order : 0);
+    if(!found || (newest ? age > 0 : age < 0)) {
+      found = request;
+    }
+  }
+  return found;
+}
+
+// The waiting request to send next, if one may be sent now. Interactive requests go first, unless a background
+// request has waited BACKGROUND_MAX_WAIT_MS, and background requests leave one in-flight slot free for them.
+static Request* request_next() {
+  if(s_in_flight_count >= MAX_IN_FLIGHT) {
+    return NULL;
+  }
+
+  Request *interactive = request_waiting(LaneInteractive, false, true);
+  Request *background = request_waiting(LaneBackground, false, true);
+  int background_in_flight = 0;
+  for(int i = 0; i < QUEUE_SIZE; i++) {
+    if(s_requests[i].status == RequestStatusInFlight && s_requests[i].lane == LaneBackground) {
+      background_in_flight++;
+    }
+  }
+  if(background_in_flight >= MAX_IN_FLIGHT - 1) {
+    background = NULL;
+  }
+
+  if(interactive && background && now_ms() - background->queued_ms >= BACKGROUND_MAX_WAIT_MS) {
+    return background;
+  }
+  return interactive ? interactive : background;
+}
+
+static bool request_add(Request *request) {
+  Lane lane = (request->request_type == RequestTypeGetData) ? LaneBackground : LaneInteractive;
+  Request *slot = NULL;
+  for(int i = 0; !slot && i < QUEUE_SIZE; i++) {
+    if(s_requests[i].status == RequestStatusFree) {
+      slot = &s_requests[i];
+    }
+  }
+
+  // An interactive request takes the place of the newest background request still waiting
+  if(!slot && lane == LaneInteractive) {
+    slot = request_waiting(LaneBackground, true, false);
+    if(slot) {
+      DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Request queue is full, dropping a background request");
+      s_stats.queue_full++;
+      s_error_callback(ErrorCodeQueueFull);
+      request_remove(slot);
+    }
+  }
+
+  if(!slot) {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Request queue is full (%d requests)!", QUEUE_SIZE);
+    s_stats.queue_full++;
+    s_error_callback(ErrorCodeQueueFull);
+    return false;
+  }
+
+  *slot = *request;
+  slot->status = RequestStatusWaiting;
+  slot->order = s_next_order++;
+  slot->lane = lane;
+  slot->queued_ms = now_ms();
+
+  // Any non-zero ID not already in use, so late responses to earlier requests are not mistaken for this one
+  do {
+    s_last_id++;
+  } while(s_last_id == 0 || request_find(s_last_id));
+  slot->id = s_last_id;
+  return true;
+}
+
+static void call_data_callback(Request *request, int type, DataValue value) {
+  if(request->data_context_callback) {
+    request->data_context_callback(type, value, request->context);
+  } else if(request->data_callback) {
+    request->data_callback(type, value);
+  }
+}
+
+static void call_feature_callback(Request *request, int type, int state) {
+  if(request->feature_context_callback) {
+    request->feature_context_callback(type, state, request->context);
+  } else if(request->feature_callback) {
+    request->feature_callback(type, state);
+  }
+}
 
 /**
  * Packet Formats 
  *
  * (From Android):
+ * HEADER:
+ *   AppKeyRequestId       - The ID of the request this responds to
+ *   AppKeySession         - Session token after a handshake, or 0 if the session is unknown and the
+ *                           request should be sent again with the handshake header
+ * OTHER:
  *   RequestTypeGetData
  *     AppKeyDataType      - DataType
+ *     [AppKeyValueHash]   - value_hash() of the cached string value, if there is one
+ *   RequestTypeGetData (batch)
+ *     <DataType>          - value_hash() of the cached string value, or 0, for each DataType requested
  *   RequestTypeSetFeature
  *     AppKeyFeatureType   - FeatureType
  *     AppKeyFeatureState  - FeatureState
+ *   RequestTypeSetFeature (several)
+ *     <FeatureType>       - FeatureState, for each FeatureType to set
  *   RequestTypeGetFeature
  *     AppKeyFeatureType   - FeatureType
+ *   RequestTypeSubscribe
+ *     AppKeyDataType      - DataType
+ *     AppKeyMinInterval   - Minimum milliseconds between pushes
+ *   RequestTypeUnsubscribe
+ *     AppKeyDataType      - DataType
  *   RequestTypeError
  *     AppKeyLibraryVersion
  *
  * (To Android):
- * HEADER:
+ * HEADER (handshake, when there is no session):
  *   AppKeyUsesDashAPI
  *   AppKeyAppName
  *   AppKeyLibraryVersion
+ * HEADER (in a session):
+ *   AppKeyUsesDashAPI
+ *   AppKeySession       - Session token
+ * HEADER (always):
+ *   AppKeyRequestId     - A unique ID for each request in progress
  * OTHER:
  *   RequestTypeGetData
  *     AppKeyDataType      - DataType
  *     AppKeyDataValue     - DataValue
+ *   RequestTypeGetData (batch)
+ *     <DataType>          - DataValue, for each DataType requested
+ *   RequestTypeGetData (either)
+ *     [AppKeyNotModified] - DATA_TYPE_BIT() of each DataType sent without a value, as it matched the hash
  *   RequestTypeSetFeature
  *     AppKeyFeatureType   - FeatureType
  *     AppKeyFeatureState  - FeatureState
+ *   RequestTypeSetFeature (several)
+ *     <FeatureType>       - FeatureState, for each FeatureType set
  *   RequestTypeGetFeature
  *     AppKeyFeatureType   - FeatureType
  *     AppKeyFeatureState  - FeatureState
+ *   RequestTypeGetData (response to RequestTypeSubscribe, or pushed if AppKeyPush is present)
+ *     AppKeyDataType      - DataType
+ *     AppKeyDataValue     - DataValue
+ *     AppKeyPush          - 0
+ *   RequestTypeUnsubscribe
+ *     AppKeyDataType      - DataType
  *   RequestTypeError
- *     AppKeyErrorCode    - ErrorCodeNoPermissions | ErrorCodeWrongVersion
+ *     AppKeyErrorCode    - ErrorCodeNoPermissions | ErrorCodeWrongVersion | ErrorCodeRateLimited
  */
-static void inbox_received_handler(DictionaryIterator *inbox, void *context) {
-  cancel_timeout_timer(); // Response was quick enough
-  s_in_flight = false;
+static void send_next(uint32_t delay_ms);
+#if DASH_API_SCHEDULE
+static void schedule_run();
+#endif
+
+// Deliver a received value, unless it was already answered from the cache and has not changed since
+static void deliver_value(int type, DataValue value, Request *request) {
+  bool changed = cache_store(type, value);
+  if(!changed && (request->revalidate_types & DATA_TYPE_BIT(type))) {
+    return;
+  }
+
+  call_data_callback(request, type, value);
+}
+
+// Deliver the cached value of a DataType that the phone reports is unchanged, in place from the cache
+static void deliver_cached_value(int type, Request *request) {
+#if DASH_API_CACHE
+  CacheEntry *entry = &s_cache[type - DataTypeBatteryPercent];
+  int slot = cache_string_slot(type);
+  if(slot < 0 || !entry->valid) {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: No cached value for DataType %d", type);
+    return;
+  }
+
+  entry->updated = time(NULL);
+  persist_mark(type, false);
+  if(request->revalidate_types & DATA_TYPE_BIT(type)) {
+    return;   // Already delivered from the cache
+  }
+
+  DataValue value = {
+    .string_value = s_cache_strings[slot]
+  };
+  call_data_callback(request, type, value);
+#else
+  DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: No cached value for DataType %d", type);
+#endif
+}
+
+static void deliver_data_value(int type, Tuple *value_tuple, Request *request) {
+  if(!value_tuple) {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: No value for DataType %d", type);
+    return;
+  }
+
+  DataValue value = {0};
+  switch(type) {
+    // Data type will be integer
+    case DataTypeBatteryPercent:
+    case DataTypeGSMStrength:
+    case DataTypeStoragePercentUsed:
+    case DataTypeUnreadSMSCount:
+      if(value_tuple->type != TUPLE_INT && value_tuple->type != TUPLE_UINT) {
+        DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Value for DataType %d is not an integer", type);
+        return;
+      }
+
+      value.integer_value = value_tuple->value->int32;
+      deliver_value(type, value, request);
+      break;
+
+    // Data type will be string
+    case DataTypeWifiNetworkName:
+    case DataTypeGSMOperatorName:
+    case DataTypeStorageFreeGBString:
+    case DataTypeNextCalendarEventOneLine:
+    case DataTypeNextCalendarEventTwoLine:
+      // Delivered in place from the inbox, so must be terminated within the tuple
+      if(value_tuple->type != TUPLE_CSTRING || value_tuple->length == 0
+          || value_tuple->value->cstring[value_tuple->length - 1] != '\0') {
+        DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Value for DataType %d is not a valid string", type);
+        return;
+      }
+
+      value.string_value = value_tuple->value->cstring;
+      deliver_value(type, value, request);
+      break;
+
+    default:
+      DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Unknown DataType! %d", type);
+      break;
+  }
+}
+
+static bool is_response(DictionaryIterator *inbox) {
+  return dict_find(inbox, RequestTypeGetData) || dict_find(inbox, RequestTypeSetFeature)
+    || dict_find(inbox, RequestTypeGetFeature) || dict_find(inbox, RequestTypeUnsubscribe)
+    || dict_find(inbox, RequestTypeError) || dict_find(inbox, AppKeySession);
+}
+
+static void handle_message(DictionaryIterator *inbox) {
+  // Value pushed for a subscription, which does not complete any request
+  if(dict_find(inbox, AppKeyPush)) {
+#if DASH_API_SUBSCRIBE
+    Tuple *type_tuple = dict_find(inbox, AppKeyDataType);
+    int type = type_tuple ? type_tuple->value->int32 : 0;
+    if(type_tuple && data_type_is_valid(type)) {
+      s_stats.pushes++;
+      Subscription *subscription = &s_subscriptions[type - DataTypeBatteryPercent];
+      Request push = {
+        .data_callback = subscription->callback,
+        .data_context_callback = subscription->context_callback,
+        .context = subscription->context
+      };
+      deliver_data_value(type, dict_find(inbox, AppKeyDataValue), &push);
+    }
+#endif
+    return;
+  }
+
+  if(!is_response(inbox)) {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Unknown message type");
+    return;
+  }
+
+  s_link_open = true;
+
+  // Responses from older Android apps without an ID answer the oldest request
+  Tuple *id_tuple = dict_find(inbox, AppKeyRequestId);
+  Request *in_flight = id_tuple ? request_find(id_tuple->value->int32) : request_oldest(RequestStatusInFlight);
+  if(id_tuple && (!in_flight || in_flight->status != RequestStatusInFlight)) {
+    DASH_LOG(APP_LOG_LEVEL_INFO, "Dash API: Ignoring response to request %d, which has timed out", (int)id_tuple->value->int32);
+    s_stats.late_responses++;
+    return;
+  }
+
+  Tuple *session_tuple = dict_find(inbox, AppKeySession);
+  if(session_tuple) {
+    s_session = session_tuple->value->int32;
+    if(s_session == 0 && in_flight) {
+      // The phone no longer knows this session, so send the request again with the handshake header
+      DASH_LOG(APP_LOG_LEVEL_INFO, "Dash API: Session expired, handshaking again");
+      app_timer_cancel(in_flight->timeout_timer);
+      in_flight->timeout_timer = NULL;
+      in_flight->status = RequestStatusWaiting;
+      s_in_flight_count--;
+      send_next(0);
+      return;
+    }
+  }
+
+  // This response completes the request
+  Request request = {0};
+  if(in_flight) {
+    request = *in_flight;
+    s_stats.responses++;
+    rtt_sample(&request, now_ms() - request.sent_ms);
+    request_remove(in_flight);
+  }
 
   // Get data response
   if(dict_find(inbox, RequestTypeGetData)) {
-    DataValue value;
-
-    int type = dict_find(inbox, AppKeyDataType)->value->int32;
-    switch(type) {
-      // Data type will be integer
-      case DataTypeBatteryPercent:
-      case DataTypeGSMStrength:
-      case DataTypeStoragePercentUsed:
-      case DataTypeUnreadSMSCount:
-        value.integer_value = dict_find(inbox, AppKeyDataValue)->value->int32;
-        if(s_last_get_data_cb) {
-          s_last_get_data_cb(type, value);
+    Tuple *not_modified_tuple = dict_find(inbox, AppKeyNotModified);
+    int not_modified = not_modified_tuple ? not_modified_tuple->value->int32 : 0;
+
+    Tuple *type_tuple = dict_find(inbox, AppKeyDataType);
+    if(type_tuple) {
+      int type = type_tuple->value->int32;
+      if(not_modified && data_type_is_valid(type) && (not_modified & DATA_TYPE_BIT(type))) {
+        deliver_cached_value(type, &request);
+      } else {
+        deliver_data_value(type, dict_find(inbox, AppKeyDataValue), &request);
+      }
+    } else {
+      // Batch response, with each value keyed by its DataType
+      for(int type = DataTypeBatteryPercent; type <= DataTypeNextCalendarEventTwoLine; type++) {
+        Tuple *value_tuple = dict_find(inbox, type);
+        if(not_modified & DATA_TYPE_BIT(type)) {
+          deliver_cached_value(type, &request);
+        } else if(value_tuple) {
+          deliver_data_value(type, value_tuple, &request);
         }
-        break;
+      }
+    }
+  }
 
-      // Data type will be string
-      case DataTypeWifiNetworkName:
-      case DataTypeGSMOperatorName:
-      case DataTypeStorageFreeGBString:
-      case DataTypeNextCalendarEventOneLine:
-      case DataTypeNextCalendarEventTwoLine:
-        value.string_value = malloc(INBOX_SIZE);
-        strcpy(value.string_value, dict_find(inbox, AppKeyDataValue)->value->cstring);
-        if(s_last_get_data_cb) {
-          s_last_get_data_cb(type, value);
+  // Set or get feature response
+  else if(dict_find(inbox, RequestTypeSetFeature) || dict_find(inbox, RequestTypeGetFeature)) {
+    Tuple *type_tuple = dict_find(inbox, AppKeyFeatureType);
+    Tuple *state_tuple = dict_find(inbox, AppKeyFeatureState);
+    if(type_tuple) {
+      call_feature_callback(&request, type_tuple->value->int32,
+        state_tuple ? state_tuple->value->int32 : FeatureStateUnknown);
+    } else {
+      // Several features set, with each state keyed by its FeatureType
+      for(int type = FeatureTypeWifi; type <= FeatureTypeAutoBrightness; type++) {
+        Tuple *feature_tuple = dict_find(inbox, type);
+        if(feature_tuple) {
+          call_feature_callback(&request, type, feature_tuple->value->int32);
         }
-        free(value.string_value);
-        break;
-
-      default:
-        APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Unknown DataType! %d", type);
-        break;
+      }
     }
   }
 
-  // Set feature response
-  else if(dict_find(inbox, RequestTypeSetFeature)) {
-    int type = dict_find(inbox, AppKeyFeatureType)->value->int32;
-    int state = dict_find(inbox, AppKeyFeatureState)->value->int32;
-    s_last_set_feature_cb(type, state);
+  // Unsubscribe response
+  else if(dict_find(inbox, RequestTypeUnsubscribe)) {
+    // Nothing to deliver
   }
 
-  // Get feature response
-  else if(dict_find(inbox, RequestTypeGetFeature)) {
-    int type = dict_find(inbox, AppKeyFeatureType)->value->int32;
-    int state = dict_find(inbox, AppKeyFeatureState)->value->int32;
-    s_last_get_feature_cb(type, state);
-  } 
-
   // Is available result, or no permission result
-  else if(dict_find(inbox, RequestTypeError)) {
+  else if(dict_find(inbox, AppKeyErrorCode)) {
     int code = dict_find(inbox, AppKeyErrorCode)->value->int32;
     switch(code) {
       case ErrorCodeNoPermissions:
-        APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Permission for this app has not been granted within the Dash API Android app!");
+        DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Permission for this app has not been granted within the Dash API Android app!");
         break;
       case ErrorCodeWrongVersion:
-        APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: An incompatible version of the Dash API Android app is installed!");
+        DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: An incompatible version of the Dash API Android app is installed!");
+        break;
+      case ErrorCodeRateLimited:
+        DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Too many requests, refused by the Android app!");
+        s_stats.rate_limited++;
         break;
     }
     s_error_callback(code);
   }
 
-  else {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Unknown message type");
+  // The link is open, so the next request need not wait
+  send_next(0);
+}
+
+static void inbox_received_handler(DictionaryIterator *inbox, void *context) {
+  // Messages for the app and other packages sharing pebble-events arrive here too, and are not counted
+#if DASH_API_PACKED
+  Tuple *packed_tuple = dict_find(inbox, AppKeyPacked);
+#else
+  Tuple *packed_tuple = NULL;
+#endif
+  if(!packed_tuple) {
+    if(dict_find(inbox, AppKeyPush) || is_response(inbox)) {
+      s_stats.inbox_bytes += dict_size(inbox);
+    }
+    handle_message(inbox);
+    return;
   }
+#if DASH_API_PACKED
+  s_stats.inbox_bytes += dict_size(inbox);
+
+  // Unpack into a dictionary only for as long as it is handled
+  uint32_t size = (packed_tuple->type == TUPLE_BYTE_ARRAY)
+    ? dash_packed_unpacked_size(packed_tuple->value->data, packed_tuple->length) : 0;
+  DictionaryIterator unpacked;
+  if(size && size <= sizeof(s_unpack_buffer)
+      && dash_packed_unpack(packed_tuple->value->data, packed_tuple->length, &unpacked, s_unpack_buffer, size)) {
+    handle_message(&unpacked);
+  } else {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Invalid packed message");
+  }
+#endif
 }
 
-static void write_header() {
-  packet_put_integer(AppKeyUsesDashAPI, 0);
-  packet_put_string(AppKeyAppName, s_app_name);
-  char *version = ANDROID_APP_VERSION;
-  packet_put_string(AppKeyLibraryVersion, version);
+static void put_integer(int key, int value) {
+#if DASH_API_PACKED
+  if(s_packed_writer) {
+    dash_packed_put_integer(s_packed_writer, key, value);
+    return;
+  }
+#endif
+  packet_put_integer(key, value);
 }
 
-static bool prepare_outbox() {
-  if(!s_initialized) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: dash_api_init() not yet called.");
-    s_error_callback(ErrorCodeSendingFailed);
-    return false;
+static void put_string(int key, char *string) {
+#if DASH_API_PACKED
+  if(s_packed_writer) {
+    dash_packed_put_string(s_packed_writer, key, string);
+    return;
   }
+#endif
+  packet_put_string(key, string);
+}
 
-  if(!connection_service_peek_pebble_app_connection()) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Bluetooth is disconnected!");
-    s_error_callback(ErrorCodeSendingFailed);
-    return false;
+static void write_header() {
+  put_integer(AppKeyUsesDashAPI, 0);
+  if(s_session) {
+    put_integer(AppKeySession, s_session);
+    return;
   }
 
-  if(s_in_flight) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: dash_api_get_data() failed - request already in progress!");
-    s_error_callback(ErrorCodeSendingFailed);
+  put_string(AppKeyAppName, s_app_name);
+  char *version = ANDROID_APP_VERSION;
+  put_string(AppKeyLibraryVersion, version);
+}
+
+// Begin a message. Failures are retried by the caller.
+static bool prepare_outbox() {
+  if(!connection_service_peek_pebble_app_connection()) {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Bluetooth is disconnected!");
     return false;
   }
 
+#if DASH_API_PACKED
+  // A packed message is written to the outbox once complete
+  bool success = s_packed_writer || packet_begin();
+#else
   bool success = packet_begin();
+#endif
   if(!success) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Error opening outbox!");
-    s_error_callback(ErrorCodeSendingFailed);
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Error opening outbox!");
     return false;
   }
 
@@ -220,38 +1106,323 @@ static bool prepare_outbox() {
   return true;
 }
 
+static void write_request(Request *request) {
+  switch(request->request_type) {
+    case RequestTypeGetData:
+      put_integer(RequestTypeGetData, 0);
+      // The phone answers string values matching the hash of a cached value with AppKeyNotModified instead
+      if(request->data_types == DATA_TYPE_BIT(request->type)) {
+        put_integer(AppKeyDataType, request->type);
+        int32_t hash = cache_value_hash(request->type);
+        if(hash) {
+          put_integer(AppKeyValueHash, hash);
+        }
+      } else {
+        for(int type = DataTypeBatteryPercent; type <= DataTypeNextCalendarEventTwoLine; type++) {
+          if(request->data_types & DATA_TYPE_BIT(type)) {
+            put_integer(type, cache_value_hash(type));
+          }
+        }
+      }
+      break;
+
+#if DASH_API_SET_FEATURE
+    case RequestTypeSetFeature: {
+      put_integer(RequestTypeSetFeature, 0);
+      if(request->feature_states) {
+        for(int type = FeatureTypeWifi; type <= FeatureTypeAutoBrightness; type++) {
+          int state = (request->feature_states >> FEATURE_STATE_SHIFT(type)) & 0xF;
+          if(state) {
+            put_integer(type, state);
+          }
+        }
+        break;
+      }
+
+      put_integer(AppKeyFeatureType, request->type);
+      const int state = (int)request->feature_state; // Prevents 2 becoming 119762434
+      put_integer(AppKeyFeatureState, state);
+    } break;
+#endif
+
+    case RequestTypeGetFeature:
+      put_integer(RequestTypeGetFeature, 0);
+      put_integer(AppKeyFeatureType, request->type);
+      break;
+
+#if DASH_API_SUBSCRIBE
+    case RequestTypeSubscribe:
+      put_integer(RequestTypeSubscribe, 0);
+      put_integer(AppKeyDataType, request->type);
+      put_integer(AppKeyMinInterval, request->min_interval_ms);
+      break;
+
+    case RequestTypeUnsubscribe:
+      put_integer(RequestTypeUnsubscribe, 0);
+      put_integer(AppKeyDataType, request->type);
+      break;
+#endif
+
+    default:
+      put_integer(request->request_type, 0);
+      break;
+  }
+}
+
+static void count_sent(RequestType request_type) {
+  switch(request_type) {
+    case RequestTypeGetData:     s_stats.get_data_sent++; break;
+    case RequestTypeSetFeature:  s_stats.set_feature_sent++; break;
+    case RequestTypeGetFeature:  s_stats.get_feature_sent++; break;
+    case RequestTypeSubscribe:   s_stats.subscribe_sent++; break;
+    case RequestTypeUnsubscribe: s_stats.unsubscribe_sent++; break;
+    case RequestTypeIsAvailable: s_stats.is_available_sent++; break;
+    default: break;
+  }
+}
+
+// Drop a request without a response, and move on to the next
+static void abandon_request(Request *request) {
+  if(request) {
+    request_remove(request);
+  }
+  send_next(0);
+}
+
+static void retry_timer_callback(void *context) {
+  s_retry_timer = NULL;   // It went off
+  send_next(0);
+}
+
+// Set the retry timer for the first waiting request that is backing off
+static void retry_timer_update() {
+  if(s_retry_timer) {
+    app_timer_cancel(s_retry_timer);
+    s_retry_timer = NULL;
+  }
+
+  int32_t wait_ms = INT32_MAX;
+  for(int i = 0; i < QUEUE_SIZE; i++) {
+    Request *request = &s_requests[i];
+    if(request->status == RequestStatusWaiting && request->attempts) {
+      int32_t remaining_ms = request->retry_ms - now_ms();
+      wait_ms = (remaining_ms < wait_ms) ? remaining_ms : wait_ms;
+    }
+  }
+  if(wait_ms != INT32_MAX) {
+    s_retry_timer = app_timer_register((wait_ms > 0) ? wait_ms : 0, retry_timer_callback, NULL);
+  }
+}
+
+// A request could not be sent. Queue it again after an exponential backoff with jitter, or once the retry
+// policy's attempts or deadline are used up, report ErrorCodeSendingFailed and drop it.
+static void retry_or_fail(Request *request) {
+  request->attempts++;
+  int delay_ms = s_retry.initial_delay_ms;
+  for(int i = 1; i < request->attempts && delay_ms < RETRY_MAX_DELAY_MS; i++) {
+    delay_ms *= 2;
+  }
+  delay_ms = (delay_ms < RETRY_MAX_DELAY_MS) ? delay_ms : RETRY_MAX_DELAY_MS;
+  delay_ms = delay_ms / 2 + rand() % (delay_ms / 2 + 1);   // So that apps that failed together retry apart
+
+  uint32_t retry_ms = now_ms() + delay_ms;
+  if(request->attempts >= s_retry.max_attempts
+      || (int32_t)(retry_ms - request->queued_ms) >= s_retry.deadline_ms) {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Giving up after %d attempts.", request->attempts);
+    s_stats.send_failures++;
+    s_error_callback(ErrorCodeSendingFailed);
+    abandon_request(request);
+    return;
+  }
+
+  if(request->timeout_timer) {
+    app_timer_cancel(request->timeout_timer);
+    request->timeout_timer = NULL;
+  }
+  if(request->status == RequestStatusInFlight) {
+    s_in_flight_count--;
+  }
+  request->status = RequestStatusWaiting;
+  request->retry_ms = retry_ms;
+  s_stats.retries++;
+  retry_timer_update();
+  send_next(0);
+}
+
 static void timeout_handler(void *context) {
-  s_timeout_timer = NULL;
+  Request *request = context;
+  request->timeout_timer = NULL;
+  rtt_backoff(request);
+  if(request->id == s_outbox_request_id) {
+    s_outbox_busy = false;   // In case neither outbox callback arrived
+  }
 
-  APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Timed out!");
+  DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Timed out!");
+  s_stats.timeouts++;
   s_error_callback(ErrorCodeUnavailable);
+  abandon_request(request);
 }
 
 static void failed_callback() {
-  APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Packet send failed.");
-  s_error_callback(ErrorCodeSendingFailed);
+  if(!s_outbox_busy) {
+    return;   // Already handled, as both pebble-packet and outbox_failed_handler() report a failure
+  }
+
+  DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Packet send failed.");
+  s_outbox_busy = false;
+
+  // Busy, NACKed or timed out, so the phone did not receive it
+  Request *request = request_find(s_outbox_request_id);
+  if(request && request->status == RequestStatusInFlight) {
+    retry_or_fail(request);
+  } else {
+    send_next(0);
+  }
+}
+
+static void outbox_failed_handler(DictionaryIterator *iter, AppMessageResult reason, void *context) {
+  failed_callback();
+}
+
+static void outbox_sent_handler(DictionaryIterator *iter, void *context) {
+  // Every request holds AppKeyUsesDashAPI, or AppKeyPacked in the packed format
+  if(dict_find(iter, AppKeyUsesDashAPI) || dict_find(iter, AppKeyPacked)) {
+    s_stats.outbox_bytes += dict_size(iter);
+  }
+  s_outbox_busy = false;
+  send_next(0);
+}
+
+// Send the message written since prepare_outbox()
+static bool send_outbox() {
+#if DASH_API_PACKED
+  if(!s_packed_writer) {
+    return packet_send(failed_callback);
+  }
+
+  if(s_packed_writer->overflow) {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Packed message too large!");
+    return false;
+  }
+
+  DictionaryIterator *iter;
+  if(app_message_outbox_begin(&iter) != APP_MSG_OK) {
+    return false;
+  }
+  dict_write_data(iter, AppKeyPacked, s_packed_writer->buffer, s_packed_writer->length);
+  return app_message_outbox_send() == APP_MSG_OK;
+#else
+  return packet_send(failed_callback);
+#endif
 }
 
 static void send_outbox_callback() {
   s_send_timer = NULL;   // It went off
 
-  if(!packet_send(failed_callback)) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Error sending outbox!");
-    s_error_callback(ErrorCodeSendingFailed);
+  Request *request = s_outbox_busy ? NULL : request_next();
+  if(!request) {
+    return;
+  }
+
+#if DASH_API_PACKED
+  uint8_t packed_buffer[OUTBOX_SIZE - PACKED_OVERHEAD];
+  DashPackedWriter writer;
+  if(s_packed_format) {
+    dash_packed_begin(&writer, packed_buffer, sizeof(packed_buffer));
+    s_packed_writer = &writer;
   }
+#endif
+
+  if(!prepare_outbox()) {
+#if DASH_API_PACKED
+    s_packed_writer = NULL;
+#endif
+    retry_or_fail(request);
+    return;
+  }
+
+  put_integer(AppKeyRequestId, request->id);
+  write_request(request);
+  bool sent = send_outbox();
+#if DASH_API_PACKED
+  s_packed_writer = NULL;
+#endif
+  if(!sent) {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Error sending outbox!");
+    retry_or_fail(request);
+    return;
+  }
+
+  count_sent(request->request_type);
 
   // Begin timeout timer
-  cancel_timeout_timer();
-  s_timeout_timer = app_timer_register(TIMEOUT_MS, timeout_handler, NULL);
+  request->timeout_timer = app_timer_register(rtt_timeout(request), timeout_handler, request);
+  request->sent_ms = now_ms();
+  request->status = RequestStatusInFlight;
+  s_in_flight_count++;
+  s_outbox_request_id = request->id;
+  s_outbox_busy = true;
+}
+
+// Send the next waiting request after delay_ms, once the outbox is free and fewer than MAX_IN_FLIGHT
+// are awaiting a response
+static void send_next(uint32_t delay_ms) {
+  if(s_send_timer || s_outbox_busy || !request_next()) {
+    return;
+  }
 
-  s_in_flight = true;
+  s_send_timer = app_timer_register(delay_ms, send_outbox_callback, NULL);
 }
 
-static void send_outbox() {
-  cancel_send_timer();
-  s_send_timer = app_timer_register(DELAY_MS, send_outbox_callback, NULL);
+static void connection_handler(bool connected) {
+  if(!connected) {
+    // The phone may not keep the session, so handshake again on reconnection. AppMessage is not known to be
+    // open until a response arrives, and round trip times measured before may not hold for the new link.
+    s_session = 0;
+    s_link_open = false;
+    memset(s_rtt, 0, sizeof(s_rtt));
+    return;
+  }
+
+  // Requests backing off after failing to send while disconnected can go now
+  for(int i = 0; i < QUEUE_SIZE; i++) {
+    s_requests[i].retry_ms = now_ms();
+  }
+  retry_timer_update();
+  send_next(0);
+
+#if DASH_API_SCHEDULE
+  // Catch up on refreshes that fell due while disconnected
+  schedule_run();
+#endif
+}
+
+// Queue a request, to be sent as soon as the outbox is free
+static void enqueue(Request *request) {
+  if(!s_initialized) {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: dash_api_init() not yet called.");
+    s_stats.send_failures++;
+    s_error_callback(ErrorCodeSendingFailed);
+    return;
+  }
+
+  // Without retries, a request made while disconnected fails at once. Otherwise it waits for reconnection.
+  if(s_retry.max_attempts <= 1 && !connection_service_peek_pebble_app_connection()) {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Bluetooth is disconnected!");
+    s_stats.send_failures++;
+    s_error_callback(ErrorCodeSendingFailed);
+    return;
+  }
+
+  if(!request_add(request)) {
+    return;
+  }
+
+  // Once a response has arrived, AppMessage is known to be open and the request can go immediately
+  send_next(s_link_open ? 0 : DELAY_MS);
 }
 
+#if DASH_API_LOGGING && DASH_API_DEBUG_NAMES
 static char* datatype_to_string(DataType type) {
   switch(type) {
     case DataTypeBatteryPercent: return "DataTypeBatteryPercent";
@@ -279,6 +1450,7 @@ static char* featuretype_to_string(FeatureType type) {
   }
 }
 
+#if DASH_API_SET_FEATURE
 static char* featurestate_to_string(FeatureState state) {
   switch(state) {
     case FeatureStateUnknown: return "FeatureStateUnknown";
@@ -290,35 +1462,187 @@ static char* featurestate_to_string(FeatureState state) {
     default: return "Unknown FeatureState";
   }
 }
+#endif
+#endif
 
-/************************************ API *************************************/
+/********************************* Schedule ***********************************/
 
-void dash_api_get_data(DataType type, DashAPIDataCallback *callback) {
-  if(!prepare_outbox()) {
+#if DASH_API_SCHEDULE
+static void get_data_batch(const DataType *types, int count, Request *request);
+
+static void schedule_data_callback(DataType type, DataValue value, void *context) {
+  Schedule *schedule = &s_schedules[type - DataTypeBatteryPercent];
+  if(schedule->period_s <= 0) {
+    return;   // Unscheduled since the request was made
+  }
+
+  if(schedule->context_callback) {
+    schedule->context_callback(type, value, schedule->context);
+  } else if(schedule->callback) {
+    schedule->callback(type, value);
+  }
+}
+
+static void schedule_get_data(const DataType *types, int count) {
+  Request request = {
+    .data_context_callback = schedule_data_callback
+  };
+  get_data_batch(types, count, &request);
+}
+
+// Refresh every scheduled DataType due before the next window in one batch. While the phone is disconnected
+// nothing is sent, and connection_handler() runs the window again on reconnection.
+static void schedule_run() {
+  if(!s_initialized || !connection_service_peek_pebble_app_connection()) {
     return;
   }
 
+  DataType types[NUM_DATA_TYPES];
+  int count = 0;
+  time_t now = time(NULL);
+  for(int type = DataTypeBatteryPercent; type <= DataTypeNextCalendarEventTwoLine; type++) {
+    Schedule *schedule = &s_schedules[type - DataTypeBatteryPercent];
+    if(schedule->period_s <= 0 || schedule->due >= now + SCHEDULE_WINDOW_S) {
+      continue;
+    }
+
+    schedule->due = now + schedule->period_s;
+    types[count++] = type;
+  }
+
+  if(count > 0) {
+    schedule_get_data(types, count);
+  }
+}
+
+// Leave an unscheduled DataType out of the scheduled requests still waiting to be sent, and drop those left with
+// none. Those already sent are answered, but schedule_data_callback() does not deliver the value.
+static void schedule_cancel(int type) {
+  for(int i = 0; i < QUEUE_SIZE; i++) {
+    Request *request = &s_requests[i];
+    if(request->status != RequestStatusWaiting || request->data_context_callback != schedule_data_callback
+        || !(request->data_types & DATA_TYPE_BIT(type))) {
+      continue;
+    }
+
+    request->data_types &= ~DATA_TYPE_BIT(type);
+    request->revalidate_types &= ~DATA_TYPE_BIT(type);
+    if(!request->data_types) {
+      request_remove(request);
+      continue;
+    }
+
+    // Sent as a batch unless only one DataType is left
+    if(request->type == type) {
+      for(int other = DataTypeBatteryPercent; other <= DataTypeNextCalendarEventTwoLine; other++) {
+        if(request->data_types & DATA_TYPE_BIT(other)) {
+          request->type = other;
+          break;
+        }
+      }
+    }
+  }
+}
+
+static void schedule_timer_callback(void *context) {
+  s_schedule_timer = NULL;
+  schedule_run();
+}
+
+static void tick_handler(struct tm *tick_time, TimeUnits units_changed) {
+  schedule_run();
+}
+
+static void schedule_add(DataType type, int period_s, Schedule *entry) {
   if(!data_type_is_valid(type)) {
     return;
   }
+  if(period_s <= 0) {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Refresh period must be positive: %d", period_s);
+    return;
+  }
 
-  packet_put_integer(RequestTypeGetData, 0);
-  packet_put_integer(AppKeyDataType, type);
+  LOG_REQUEST("Dash API: dash_api_schedule %s %ds", datatype_to_string(type), period_s);
 
-  if(s_log_requests) {
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Dash API: dash_api_get_data %s", datatype_to_string(type));
+  entry->period_s = period_s;
+  entry->due = 0;
+  s_schedules[type - DataTypeBatteryPercent] = *entry;
+  if(!s_tick_handle) {
+    s_tick_handle = events_tick_timer_service_subscribe(MINUTE_UNIT, tick_handler);
   }
 
-  s_last_get_data_type = type;
-  s_last_get_data_cb = callback;
-  send_outbox();
+  // The first refresh is not left until the next tick, but made together with any others scheduled now
+  if(!s_schedule_timer) {
+    s_schedule_timer = app_timer_register(0, schedule_timer_callback, NULL);
+  }
 }
+#endif
 
-void dash_api_set_feature(FeatureType type, FeatureState new_state, DashAPIFeatureCallback *callback) {
-  if(!prepare_outbox()) {
+/************************************ API *************************************/
+
+// Queue requests for the DataTypes not answered by the cache, in as few as have responses that fit the inbox.
+// request holds the callbacks.
+static void get_data_batch(const DataType *types, int count, Request *request) {
+  if(!types || count < 1) {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: dash_api_get_data_batch() requires at least one DataType");
     return;
   }
 
+  for(int i = 0; i < count; i++) {
+    if(!data_type_is_valid(types[i])) {
+      return;
+    }
+  }
+
+  request->request_type = RequestTypeGetData;
+  uint32_t requested = 0;
+  int response_size = response_header_size();
+  for(int i = 0; i < count; i++) {
+    DataType type = types[i];
+    if(requested & DATA_TYPE_BIT(type)) {
+      continue;
+    }
+    requested |= DATA_TYPE_BIT(type);
+
+    // Answer from the cache where possible, and only refresh when the value is stale or unknown
+    DataValue value;
+    CacheResult result = cache_lookup(type, &value);
+    if(result != CacheResultMiss) {
+      call_data_callback(request, type, value);
+    }
+    if(result == CacheResultFresh) {
+      continue;
+    }
+
+    LOG_REQUEST("Dash API: dash_api_get_data %s", datatype_to_string(type));
+
+    // Send the DataTypes so far, and the rest in another request with the same callbacks
+    int size = response_tuple_size(type);
+    if(request->data_types && response_size + size > INBOX_SIZE) {
+      Request rest = *request;
+      rest.data_types = rest.revalidate_types = 0;
+      enqueue(request);
+      *request = rest;
+      response_size = response_header_size();
+    }
+    response_size += size;
+
+    if(!request->data_types) {
+      request->type = type;
+    }
+    request->data_types |= DATA_TYPE_BIT(type);
+    if(result == CacheResultStale) {
+      request->revalidate_types |= DATA_TYPE_BIT(type);
+    }
+  }
+
+  if(request->data_types) {
+    enqueue(request);
+  }
+}
+
+#if DASH_API_SET_FEATURE
+static void set_feature(FeatureType type, FeatureState new_state, Request *request) {
   if(!feature_type_is_valid(type)) {
     return;
   }
@@ -327,46 +1651,242 @@ void dash_api_set_feature(FeatureType type, FeatureState new_state, DashAPIFeatu
     return;
   }
 
-  packet_put_integer(RequestTypeSetFeature, 0);
-  packet_put_integer(AppKeyFeatureType, type);
-  const int state = (int)new_state; // Prevents 2 becoming 119762434
-  packet_put_integer(AppKeyFeatureState, state);
+  LOG_REQUEST("Dash API: dash_api_set_feature %s %s", featuretype_to_string(type), featurestate_to_string(new_state));
+
+  request->request_type = RequestTypeSetFeature;
+  request->type = type;
+  request->feature_state = new_state;
+  enqueue(request);
+}
+
+// Queue one request setting several features, or a single set request if there is only one
+static void set_features(const FeatureType *types, const FeatureState *states, int count, Request *request) {
+  if(!types || !states || count < 1) {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: dash_api_set_features() requires at least one FeatureType");
+    return;
+  }
+  if(count == 1) {
+    set_feature(types[0], states[0], request);
+    return;
+  }
 
-  if(s_log_requests) {
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Dash API: dash_api_set_feature %s %s", featuretype_to_string(type), featurestate_to_string(new_state));
+  for(int i = 0; i < count; i++) {
+    if(!feature_type_is_valid(types[i]) || !feature_state_is_valid(states[i])) {
+      return;
+    }
   }
 
-  s_last_set_feature_type = type;
-  s_last_set_feature_cb = callback;
-  send_outbox();
+  request->request_type = RequestTypeSetFeature;
+  for(int i = 0; i < count; i++) {
+    LOG_REQUEST("Dash API: dash_api_set_features %s %s", featuretype_to_string(types[i]), featurestate_to_string(states[i]));
+
+    // A later state for the same FeatureType replaces an earlier one
+    request->feature_states &= ~(0xF << FEATURE_STATE_SHIFT(types[i]));
+    request->feature_states |= (uint32_t)states[i] << FEATURE_STATE_SHIFT(types[i]);
+  }
+  request->type = types[0];
+  enqueue(request);
 }
+#endif
 
-void dash_api_get_feature(FeatureType type, DashAPIFeatureCallback *callback) {
-  if(!prepare_outbox()) {
+static void get_feature(FeatureType type, Request *request) {
+  if(!feature_type_is_valid(type)) {
     return;
   }
 
-  if(!feature_type_is_valid(type)) {
+  LOG_REQUEST("Dash API: dash_api_get_feature %s", featuretype_to_string(type));
+
+  request->request_type = RequestTypeGetFeature;
+  request->type = type;
+  enqueue(request);
+}
+
+#if DASH_API_SUBSCRIBE
+static void subscribe(DataType type, int min_interval_ms, Request *request) {
+  if(!data_type_is_valid(type)) {
     return;
   }
 
-  packet_put_integer(RequestTypeGetFeature, 0);
-  packet_put_integer(AppKeyFeatureType, type);
+  LOG_REQUEST("Dash API: dash_api_subscribe %s", datatype_to_string(type));
+
+  s_subscriptions[type - DataTypeBatteryPercent] = (Subscription) {
+    .callback = request->data_callback,
+    .context_callback = request->data_context_callback,
+    .context = request->context
+  };
+
+  request->request_type = RequestTypeSubscribe;
+  request->type = type;
+  request->data_types = DATA_TYPE_BIT(type);
+  request->min_interval_ms = min_interval_ms;
+  enqueue(request);
+}
+#endif
+
+void dash_api_get_data(DataType type, DashAPIDataCallback *callback) {
+  Request request = {
+    .data_callback = callback
+  };
+  get_data_batch(&type, 1, &request);
+}
+
+void dash_api_get_data_with_context(DataType type, DashAPIDataContextCallback *callback, void *context) {
+  Request request = {
+    .data_context_callback = callback,
+    .context = context
+  };
+  get_data_batch(&type, 1, &request);
+}
+
+void dash_api_get_data_batch(const DataType *types, int count, DashAPIDataCallback *callback) {
+  Request request = {
+    .data_callback = callback
+  };
+  get_data_batch(types, count, &request);
+}
 
-  if(s_log_requests) {
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Dash API: dash_api_get_feature %s", featuretype_to_string(type));
+void dash_api_get_data_batch_with_context(const DataType *types, int count, DashAPIDataContextCallback *callback,
+                                          void *context) {
+  Request request = {
+    .data_context_callback = callback,
+    .context = context
+  };
+  get_data_batch(types, count, &request);
+}
+
+#if DASH_API_SET_FEATURE
+void dash_api_set_feature(FeatureType type, FeatureState new_state, DashAPIFeatureCallback *callback) {
+  Request request = {
+    .feature_callback = callback
+  };
+  set_feature(type, new_state, &request);
+}
+
+void dash_api_set_feature_with_context(FeatureType type, FeatureState new_state,
+                                       DashAPIFeatureContextCallback *callback, void *context) {
+  Request request = {
+    .feature_context_callback = callback,
+    .context = context
+  };
+  set_feature(type, new_state, &request);
+}
+
+void dash_api_set_features(const FeatureType *types, const FeatureState *states, int count,
+                           DashAPIFeatureCallback *callback) {
+  Request request = {
+    .feature_callback = callback
+  };
+  set_features(types, states, count, &request);
+}
+
+void dash_api_set_features_with_context(const FeatureType *types, const FeatureState *states, int count,
+                                        DashAPIFeatureContextCallback *callback, void *context) {
+  Request request = {
+    .feature_context_callback = callback,
+    .context = context
+  };
+  set_features(types, states, count, &request);
+}
+#endif
+
+void dash_api_get_feature(FeatureType type, DashAPIFeatureCallback *callback) {
+  Request request = {
+    .feature_callback = callback
+  };
+  get_feature(type, &request);
+}
+
+void dash_api_get_feature_with_context(FeatureType type, DashAPIFeatureContextCallback *callback, void *context) {
+  Request request = {
+    .feature_context_callback = callback,
+    .context = context
+  };
+  get_feature(type, &request);
+}
+
+#if DASH_API_SUBSCRIBE
+void dash_api_subscribe(DataType type, int min_interval_ms, DashAPIDataCallback *callback) {
+  Request request = {
+    .data_callback = callback
+  };
+  subscribe(type, min_interval_ms, &request);
+}
+
+void dash_api_subscribe_with_context(DataType type, int min_interval_ms, DashAPIDataContextCallback *callback,
+                                     void *context) {
+  Request request = {
+    .data_context_callback = callback,
+    .context = context
+  };
+  subscribe(type, min_interval_ms, &request);
+}
+#endif
+
+#if DASH_API_SCHEDULE
+void dash_api_schedule(DataType type, int period_s, DashAPIDataCallback *callback) {
+  Schedule entry = {
+    .callback = callback
+  };
+  schedule_add(type, period_s, &entry);
+}
+
+void dash_api_schedule_with_context(DataType type, int period_s, DashAPIDataContextCallback *callback,
+                                    void *context) {
+  Schedule entry = {
+    .context_callback = callback,
+    .context = context
+  };
+  schedule_add(type, period_s, &entry);
+}
+
+void dash_api_unschedule(DataType type) {
+  if(!data_type_is_valid(type)) {
+    return;
   }
 
-  s_last_get_feature_type = type;
-  s_last_get_feature_cb = callback;
-  send_outbox();
+  s_schedules[type - DataTypeBatteryPercent].period_s = 0;
+  schedule_cancel(type);
+  for(int i = 0; i < NUM_DATA_TYPES; i++) {
+    if(s_schedules[i].period_s > 0) {
+      return;
+    }
+  }
+
+  if(s_tick_handle) {
+    events_tick_timer_service_unsubscribe(s_tick_handle);
+    s_tick_handle = NULL;
+  }
 }
+#endif
+
+#if DASH_API_SUBSCRIBE
+void dash_api_unsubscribe(DataType type) {
+  if(!data_type_is_valid(type)) {
+    return;
+  }
+
+  LOG_REQUEST("Dash API: dash_api_unsubscribe %s", datatype_to_string(type));
+
+  s_subscriptions[type - DataTypeBatteryPercent] = (Subscription) {0};
+
+  Request request = {
+    .request_type = RequestTypeUnsubscribe,
+    .type = type
+  };
+  enqueue(&request);
+}
+#endif
 
 void dash_api_init(char *app_name, DashAPIErrorCallback *callback) {
   s_error_callback = callback;
   snprintf(s_app_name, sizeof(s_app_name), "%s", app_name);
 
   events_app_message_register_inbox_received(inbox_received_handler, NULL);
+  events_app_message_register_outbox_sent(outbox_sent_handler, NULL);
+  events_app_message_register_outbox_failed(outbox_failed_handler, NULL);
+  events_connection_service_subscribe((ConnectionHandlers) {
+    .pebble_app_connection_handler = connection_handler
+  });
   events_app_message_request_inbox_size(INBOX_SIZE);
   events_app_message_request_outbox_size(OUTBOX_SIZE);
 
@@ -374,13 +1894,21 @@ void dash_api_init(char *app_name, DashAPIErrorCallback *callback) {
   s_log_requests = false;
 }
 
-void dash_api_check_is_available() {
-  if(!prepare_outbox()) {
-    return;
+void dash_api_deinit() {
+#if DASH_API_PERSIST
+  // Write now what would have been written a few seconds after the app exits
+  if(s_persist_timer) {
+    app_timer_cancel(s_persist_timer);
   }
+  persist_flush(NULL);
+#endif
+}
 
-  packet_put_integer(RequestTypeIsAvailable, 0);
-  send_outbox();
+void dash_api_check_is_available() {
+  Request request = {
+    .request_type = RequestTypeIsAvailable
+  };
+  enqueue(&request);
 }
 
 char* dash_api_error_code_to_string(ErrorCode code) {
@@ -390,6 +1918,8 @@ char* dash_api_error_code_to_string(ErrorCode code) {
     case ErrorCodeUnavailable:   return "The Dash API Android app is not installed, or the request timed out.";
     case ErrorCodeNoPermissions: return "This app does not have write permission turned on in the Dash API Android app.";
     case ErrorCodeWrongVersion:  return "An incompatible version of the Dash API Android app is installed.";
+    case ErrorCodeQueueFull:     return "Too many requests are waiting to be sent.";
+    case ErrorCodeRateLimited:   return "This app made too many requests, so the Dash API Android app refused this one.";
     default: {
       static char s_err_buff[32];
       snprintf(s_err_buff, sizeof(s_err_buff), "Unknown error (code %d)", code);
@@ -398,63 +1928,138 @@ char* dash_api_error_code_to_string(ErrorCode code) {
   }
 }
 
-void dash_api_fake_get_data_response(DataType type, int integer_value, char *string_value) {
+#if DASH_API_FAKES
+// The request a fake response answers, which is the oldest sent, or else the oldest waiting to be sent
+static Request fake_complete_request() {
   if(!s_initialized) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: dash_api_init() not yet called.");
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: dash_api_init() not yet called.");
   }
 
-  cancel_timeout_timer();
   cancel_send_timer();
 
-  DataValue value;
-  value.integer_value = integer_value;
-  value.string_value = malloc(INBOX_SIZE);
-  if(string_value) {
-    strcpy(value.string_value, string_value);
+  Request request = {0};
+  Request *oldest = request_oldest(RequestStatusInFlight);
+  if(!oldest) {
+    oldest = request_oldest(RequestStatusWaiting);
   }
-  if(s_last_get_data_cb) {
-    s_last_get_data_cb(type, value);
+  if(oldest) {
+    request = *oldest;
   }
-  free(value.string_value);
+  abandon_request(oldest);
+  return request;
+}
+
+void dash_api_fake_get_data_response(DataType type, int integer_value, char *string_value) {
+  Request request = fake_complete_request();
+
+  DataValue value = {
+    .integer_value = integer_value,
+    .string_value = string_value ? string_value : ""
+  };
+  deliver_value(type, value, &request);
 }
 
+#if DASH_API_SET_FEATURE
 void dash_api_fake_set_feature_response(FeatureType type, FeatureState new_state) {
-  if(!s_initialized) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: dash_api_init() not yet called.");
+  Request request = fake_complete_request();
+  call_feature_callback(&request, type, new_state);
+}
+#endif
+
+void dash_api_fake_get_feature_response(FeatureType type, FeatureState new_state) {
+  Request request = fake_complete_request();
+  call_feature_callback(&request, type, new_state);
+}
+
+void dash_api_fake_error(ErrorCode code) {
+  fake_complete_request();
+
+  if(s_error_callback) {
+    s_error_callback(code);
   }
+}
+#endif
 
-  cancel_timeout_timer();
-  cancel_send_timer();
+#if DASH_API_CACHE
+void dash_api_set_cache_ttl(DataType type, int ttl_s) {
+  if(!data_type_is_valid(type)) {
+    return;
+  }
+
+  s_cache[type - DataTypeBatteryPercent].ttl_s = ttl_s;
+}
 
-  if(s_last_set_feature_cb) {
-    s_last_set_feature_cb(type, new_state);
+void dash_api_invalidate_cache(DataType type) {
+  if(!data_type_is_valid(type)) {
+    return;
   }
+
+  s_cache[type - DataTypeBatteryPercent].valid = false;
 }
 
-void dash_api_fake_get_feature_response(FeatureType type, FeatureState new_state) {
-  if(!s_initialized) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: dash_api_init() not yet called.");
+bool dash_api_get_cached(DataType type, DataValue *value, int *age_s) {
+  if(!data_type_is_valid(type) || !s_cache[type - DataTypeBatteryPercent].valid) {
+    return false;
   }
 
-  cancel_timeout_timer();
-  cancel_send_timer();
+  CacheEntry *entry = &s_cache[type - DataTypeBatteryPercent];
+  int slot = cache_string_slot(type);
+  if(value) {
+    value->integer_value = entry->integer_value;
+    value->string_value = (slot >= 0) ? s_cache_strings[slot] : NULL;
+  }
+  if(age_s) {
+    *age_s = time(NULL) - entry->updated;
+  }
+  return true;
+}
 
-  if(s_last_get_feature_cb) {
-    s_last_get_feature_cb(type, new_state);
+#if DASH_API_PERSIST
+void dash_api_persist_values(uint32_t first_key) {
+  s_persist_key = first_key;
+  if(s_persist_key) {
+    persist_load();
   }
 }
+#endif
 
-void dash_api_fake_error(ErrorCode code) {
-  if(!s_initialized) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "Dash API: dash_api_init() not yet called.");
+void dash_api_get_cache_stats(int *hits, int *misses) {
+  if(hits) {
+    *hits = s_stats.cache_hits;
   }
+  if(misses) {
+    *misses = s_stats.cache_misses;
+  }
+}
+#endif
 
-  cancel_timeout_timer();
-  cancel_send_timer();
+void dash_api_get_stats(DashAPIStats *out) {
+  if(out) {
+    *out = s_stats;
+  }
+}
 
-  if(s_error_callback) {
-    s_error_callback(code);
+void dash_api_reset_stats() {
+  memset(&s_stats, 0, sizeof(s_stats));
+}
+
+#if DASH_API_PACKED
+void dash_api_set_packed_format(bool packed) {
+  s_packed_format = packed;
+}
+#endif
+
+void dash_api_set_retry_policy(int max_attempts, int initial_delay_ms, int deadline_ms) {
+  if(max_attempts < 1 || initial_delay_ms < 1 || deadline_ms < 0) {
+    DASH_LOG(APP_LOG_LEVEL_ERROR, "Dash API: Invalid retry policy");
+    return;
   }
+
+  s_retry = (RetryPolicy) {
+    .max_attempts = max_attempts,
+    .initial_delay_ms = initial_delay_ms,
+    .deadline_ms = deadline_ms
+  };
 }
 
 void dash_api_log_requests(bool log_requests) {